@@ -0,0 +1,723 @@
+/*
+ * tmpfs: a flat, memory-resident filesystem for scratch files.
+ *
+ * Each file keeps its data in an anonymous vmobject, so the pages live
+ * in ordinary coremap frames and go out to the swap device through
+ * swapout/vmobject_evict when memory runs short, exactly like anonymous
+ * user memory. Nothing is ever written anywhere else; everything is gone
+ * at reboot.
+ *
+ * There is a single root directory and no subdirectories. A tmpfs has
+ * no device, so it is attached with vfs_addfs and cannot be unmounted.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/limits.h>
+#include <kern/stat.h>
+#include <kern/unistd.h>
+#include <lib.h>
+#include <synch.h>
+#include <array.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <fs.h>
+#include <vm.h>
+#include <machine/spl.h>
+#include <machine/vm.h>
+#include <tmpfs.h>
+
+struct tmpfs_node {
+	struct vnode tn_vnode;
+	char tn_name[NAME_MAX+1];
+	int tn_isdir;
+	int tn_linked;			/* still in the directory? */
+	off_t tn_size;
+	struct vmobject * tn_obj;	/* file data; NULL for the root */
+	struct tmpfs_node * tn_next;	/* directory chain */
+};
+
+struct tmpfs {
+	struct fs tf_fs;
+	char * tf_volname;
+	struct lock * tf_lock;		/* directory and file sizes */
+	struct tmpfs_node tf_root;
+	struct tmpfs_node * tf_files;
+};
+
+static const struct vnode_ops tmpfs_fileops;
+static const struct vnode_ops tmpfs_dirops;
+
+static
+int
+tmpfs_notdir(void)
+{
+	return ENOTDIR;
+}
+
+static
+int
+tmpfs_isdir(void)
+{
+	return EISDIR;
+}
+
+static
+int
+tmpfs_unimp(void)
+{
+	return EUNIMP;
+}
+
+#define NOTDIR ((void *)tmpfs_notdir)
+#define ISDIR ((void *)tmpfs_isdir)
+#define UNIMP ((void *)tmpfs_unimp)
+
+////////////////////////////////////////////////////////////
+//
+// File data
+
+/*
+ * Move up to one page of data between the file and UIO. The frame is
+ * pinned (marked TRASH) across the uiomove, which may fault on the user
+ * buffer and so cannot run under page_lock.
+ */
+static
+int
+tmpfs_pageio(struct tmpfs_node *tn, struct uio *uio, size_t len)
+{
+	int pgno = uio->uio_offset / PAGE_SIZE;
+	size_t off = uio->uio_offset % PAGE_SIZE;
+	int index, result, spl;
+
+	if (len > PAGE_SIZE - off) {
+		len = PAGE_SIZE - off;
+	}
+
+	lock_acquire(page_lock);
+	index = vmobject_getpage(tn->tn_obj, pgno);
+	if (index == 0) {
+		lock_release(page_lock);
+		return EIO;
+	}
+	spl = splhigh();
+	coremap[index]->status = TRASH;
+	splx(spl);
+	lock_release(page_lock);
+
+	result = uiomove((char *)PADDR_TO_KVADDR(index*PAGE_SIZE) + off,
+			 len, uio);
+
+	spl = splhigh();
+	if (coremap[index]->obj == tn->tn_obj) {
+		coremap[index]->status = DIRTY;
+	}
+	splx(spl);
+
+	return result;
+}
+
+/*
+ * Resize the file, growing or shrinking its object. Called with tf_lock.
+ */
+static
+int
+tmpfs_setsize(struct tmpfs_node *tn, off_t size)
+{
+	int npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	int index, result;
+
+	lock_acquire(page_lock);
+	result = vmobject_resize(tn->tn_obj, npages);
+	if (result == 0 && size < tn->tn_size && (size % PAGE_SIZE) != 0) {
+		/* Clear the tail of the last page, in case we grow again. */
+		index = vmobject_getpage(tn->tn_obj, npages - 1);
+		if (index != 0) {
+			bzero((char *)PADDR_TO_KVADDR(index*PAGE_SIZE)
+			      + size % PAGE_SIZE,
+			      PAGE_SIZE - size % PAGE_SIZE);
+		}
+	}
+	lock_release(page_lock);
+
+	if (result == 0) {
+		tn->tn_size = size;
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Vnode operations
+
+static
+int
+tmpfs_open(struct vnode *v, int openflags)
+{
+	struct tmpfs_node *tn = v->vn_data;
+
+	if (tn->tn_isdir && (openflags & O_ACCMODE) != O_RDONLY) {
+		return EISDIR;
+	}
+	return 0;
+}
+
+static
+int
+tmpfs_close(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+/*
+ * Called when the last reference goes away. The directory holds one
+ * reference to every linked file, so this only happens once a file has
+ * been removed and closed.
+ */
+static
+int
+tmpfs_reclaim(struct vnode *v)
+{
+	struct tmpfs_node *tn = v->vn_data;
+
+	if (tn->tn_isdir || tn->tn_linked) {
+		return EBUSY;
+	}
+
+	lock_acquire(page_lock);
+	vmobject_release(tn->tn_obj);
+	lock_release(page_lock);
+
+	vnode_cleanup(&tn->tn_vnode);
+	kfree(tn);
+	return 0;
+}
+
+static
+int
+tmpfs_read(struct vnode *v, struct uio *uio)
+{
+	struct tmpfs_node *tn = v->vn_data;
+	struct tmpfs *tf = v->vn_fs->fs_data;
+	size_t len;
+	int result = 0;
+
+	assert(uio->uio_rw == UIO_READ);
+
+	lock_acquire(tf->tf_lock);
+	while (uio->uio_resid > 0 && uio->uio_offset < tn->tn_size) {
+		len = uio->uio_resid;
+		if ((off_t)len > tn->tn_size - uio->uio_offset) {
+			len = tn->tn_size - uio->uio_offset;
+		}
+		result = tmpfs_pageio(tn, uio, len);
+		if (result) {
+			break;
+		}
+	}
+	lock_release(tf->tf_lock);
+
+	return result;
+}
+
+static
+int
+tmpfs_write(struct vnode *v, struct uio *uio)
+{
+	struct tmpfs_node *tn = v->vn_data;
+	struct tmpfs *tf = v->vn_fs->fs_data;
+	off_t end = uio->uio_offset + uio->uio_resid;
+	int result = 0;
+
+	assert(uio->uio_rw == UIO_WRITE);
+
+	lock_acquire(tf->tf_lock);
+	if (end > tn->tn_size) {
+		result = tmpfs_setsize(tn, end);
+	}
+	while (result == 0 && uio->uio_resid > 0) {
+		result = tmpfs_pageio(tn, uio, uio->uio_resid);
+	}
+	lock_release(tf->tf_lock);
+
+	return result;
+}
+
+static
+int
+tmpfs_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+tmpfs_gettype(struct vnode *v, u_int32_t *result)
+{
+	struct tmpfs_node *tn = v->vn_data;
+
+	*result = tn->tn_isdir ? S_IFDIR : S_IFREG;
+	return 0;
+}
+
+static
+int
+tmpfs_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct tmpfs_node *tn = v->vn_data;
+	int result;
+
+	bzero(statbuf, sizeof(struct stat));
+
+	result = VOP_GETTYPE(v, &statbuf->st_mode);
+	if (result) {
+		return result;
+	}
+	statbuf->st_size = tn->tn_size;
+	statbuf->st_nlink = tn->tn_linked;
+	statbuf->st_blocks = (tn->tn_size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	return 0;
+}
+
+static
+int
+tmpfs_tryseek(struct vnode *v, off_t pos)
+{
+	(void)v;
+	return pos < 0 ? EINVAL : 0;
+}
+
+static
+int
+tmpfs_fsync(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+static
+int
+tmpfs_truncate(struct vnode *v, off_t len)
+{
+	struct tmpfs_node *tn = v->vn_data;
+	struct tmpfs *tf = v->vn_fs->fs_data;
+	int result;
+
+	if (len < 0) {
+		return EINVAL;
+	}
+
+	lock_acquire(tf->tf_lock);
+	result = tmpfs_setsize(tn, len);
+	lock_release(tf->tf_lock);
+
+	return result;
+}
+
+static
+int
+tmpfs_namefile(struct vnode *v, struct uio *uio)
+{
+	/* The root is the only directory, and its name is empty. */
+	(void)v;
+	(void)uio;
+	return 0;
+}
+
+/*
+ * Find NAME in the directory. Called with tf_lock.
+ */
+static
+struct tmpfs_node *
+tmpfs_find(struct tmpfs *tf, const char *name)
+{
+	struct tmpfs_node *tn;
+
+	for (tn = tf->tf_files; tn != NULL; tn = tn->tn_next) {
+		if (!strcmp(tn->tn_name, name)) {
+			return tn;
+		}
+	}
+	return NULL;
+}
+
+static
+int
+tmpfs_creat(struct vnode *dir, const char *name, int excl,
+	    struct vnode **result)
+{
+	struct tmpfs *tf = dir->vn_fs->fs_data;
+	struct tmpfs_node *tn;
+	int err;
+
+	if (strlen(name) > NAME_MAX) {
+		return ENAMETOOLONG;
+	}
+	if (!strcmp(name, "") || !strcmp(name, ".") || !strcmp(name, "..")) {
+		return EEXIST;
+	}
+
+	lock_acquire(tf->tf_lock);
+
+	tn = tmpfs_find(tf, name);
+	if (tn != NULL) {
+		lock_release(tf->tf_lock);
+		if (excl) {
+			return EEXIST;
+		}
+		VOP_INCREF(&tn->tn_vnode);
+		*result = &tn->tn_vnode;
+		return 0;
+	}
+
+	tn = kmalloc(sizeof(struct tmpfs_node));
+	if (tn == NULL) {
+		lock_release(tf->tf_lock);
+		return ENOMEM;
+	}
+	strcpy(tn->tn_name, name);
+	tn->tn_isdir = 0;
+	tn->tn_linked = 1;
+	tn->tn_size = 0;
+
+	lock_acquire(page_lock);
+	tn->tn_obj = vmobject_create(NULL, 1);
+	lock_release(page_lock);
+	if (tn->tn_obj == NULL) {
+		lock_release(tf->tf_lock);
+		kfree(tn);
+		return ENOMEM;
+	}
+
+	/* The directory's reference; the caller gets another. */
+	err = vnode_init(&tn->tn_vnode, &tmpfs_fileops, &tf->tf_fs, tn);
+	if (err) {
+		lock_acquire(page_lock);
+		vmobject_release(tn->tn_obj);
+		lock_release(page_lock);
+		lock_release(tf->tf_lock);
+		kfree(tn);
+		return err;
+	}
+
+	tn->tn_next = tf->tf_files;
+	tf->tf_files = tn;
+	lock_release(tf->tf_lock);
+
+	VOP_INCREF(&tn->tn_vnode);
+	*result = &tn->tn_vnode;
+	return 0;
+}
+
+static
+int
+tmpfs_remove(struct vnode *dir, const char *name)
+{
+	struct tmpfs *tf = dir->vn_fs->fs_data;
+	struct tmpfs_node **prev;
+	struct tmpfs_node *tn;
+
+	lock_acquire(tf->tf_lock);
+	for (prev = &tf->tf_files; *prev != NULL; prev = &(*prev)->tn_next) {
+		tn = *prev;
+		if (!strcmp(tn->tn_name, name)) {
+			*prev = tn->tn_next;
+			tn->tn_linked = 0;
+			lock_release(tf->tf_lock);
+
+			/* Drop the directory's reference. */
+			VOP_DECREF(&tn->tn_vnode);
+			return 0;
+		}
+	}
+	lock_release(tf->tf_lock);
+	return ENOENT;
+}
+
+static
+int
+tmpfs_rename(struct vnode *d1, const char *n1,
+	     struct vnode *d2, const char *n2)
+{
+	struct tmpfs *tf = d1->vn_fs->fs_data;
+	struct tmpfs_node *tn;
+
+	assert(d1 == d2);
+
+	if (strlen(n2) > NAME_MAX) {
+		return ENAMETOOLONG;
+	}
+
+	lock_acquire(tf->tf_lock);
+	tn = tmpfs_find(tf, n1);
+	if (tn == NULL) {
+		lock_release(tf->tf_lock);
+		return ENOENT;
+	}
+	if (tmpfs_find(tf, n2) != NULL) {
+		lock_release(tf->tf_lock);
+		return EEXIST;
+	}
+	strcpy(tn->tn_name, n2);
+	lock_release(tf->tf_lock);
+
+	return 0;
+}
+
+static
+int
+tmpfs_getdirentry(struct vnode *dir, struct uio *uio)
+{
+	struct tmpfs *tf = dir->vn_fs->fs_data;
+	struct tmpfs_node *tn;
+	off_t slot = uio->uio_offset;
+	off_t i;
+	int result = 0;
+
+	lock_acquire(tf->tf_lock);
+	for (i = 0, tn = tf->tf_files; tn != NULL && i < slot;
+	     i++, tn = tn->tn_next) {
+		/* nothing */
+	}
+	if (tn != NULL) {
+		result = uiomove(tn->tn_name, strlen(tn->tn_name), uio);
+	}
+	lock_release(tf->tf_lock);
+
+	/* The offset is a slot number, not a byte count. */
+	uio->uio_offset = tn != NULL ? slot + 1 : slot;
+	return result;
+}
+
+static
+int
+tmpfs_lookup(struct vnode *dir, char *path, struct vnode **result)
+{
+	struct tmpfs *tf = dir->vn_fs->fs_data;
+	struct tmpfs_node *tn;
+
+	while (*path == '/') {
+		path++;
+	}
+	if (!strcmp(path, "") || !strcmp(path, ".")) {
+		VOP_INCREF(dir);
+		*result = dir;
+		return 0;
+	}
+	if (strchr(path, '/') != NULL) {
+		return ENOTDIR;
+	}
+
+	lock_acquire(tf->tf_lock);
+	tn = tmpfs_find(tf, path);
+	if (tn == NULL) {
+		lock_release(tf->tf_lock);
+		return ENOENT;
+	}
+	VOP_INCREF(&tn->tn_vnode);
+	lock_release(tf->tf_lock);
+
+	*result = &tn->tn_vnode;
+	return 0;
+}
+
+static
+int
+tmpfs_lookparent(struct vnode *dir, char *path, struct vnode **result,
+		 char *buf, size_t buflen)
+{
+	while (*path == '/') {
+		path++;
+	}
+	if (strchr(path, '/') != NULL) {
+		return ENOTDIR;
+	}
+	if (strlen(path) + 1 > buflen) {
+		return ENAMETOOLONG;
+	}
+	strcpy(buf, path);
+
+	VOP_INCREF(dir);
+	*result = dir;
+	return 0;
+}
+
+static const struct vnode_ops tmpfs_fileops = {
+	VOP_MAGIC,	/* mark this a valid vnode ops table */
+
+	tmpfs_open,
+	tmpfs_close,
+	tmpfs_reclaim,
+
+	tmpfs_read,
+	NOTDIR,  /* readlink */
+	NOTDIR,  /* getdirentry */
+	tmpfs_write,
+	tmpfs_ioctl,
+	tmpfs_stat,
+	tmpfs_gettype,
+	tmpfs_tryseek,
+	tmpfs_fsync,
+	UNIMP,   /* mmap */
+	tmpfs_truncate,
+	NOTDIR,  /* namefile */
+
+	NOTDIR,  /* creat */
+	NOTDIR,  /* symlink */
+	NOTDIR,  /* mkdir */
+	NOTDIR,  /* link */
+	NOTDIR,  /* remove */
+	NOTDIR,  /* rmdir */
+	NOTDIR,  /* rename */
+
+	NOTDIR,  /* lookup */
+	NOTDIR,  /* lookparent */
+};
+
+static const struct vnode_ops tmpfs_dirops = {
+	VOP_MAGIC,	/* mark this a valid vnode ops table */
+
+	tmpfs_open,
+	tmpfs_close,
+	tmpfs_reclaim,
+
+	ISDIR,   /* read */
+	ISDIR,   /* readlink */
+	tmpfs_getdirentry,
+	ISDIR,   /* write */
+	tmpfs_ioctl,
+	tmpfs_stat,
+	tmpfs_gettype,
+	tmpfs_tryseek,
+	tmpfs_fsync,
+	ISDIR,   /* mmap */
+	ISDIR,   /* truncate */
+	tmpfs_namefile,
+
+	tmpfs_creat,
+	UNIMP,   /* symlink */
+	UNIMP,   /* mkdir */
+	UNIMP,   /* link */
+	tmpfs_remove,
+	UNIMP,   /* rmdir */
+	tmpfs_rename,
+
+	tmpfs_lookup,
+	tmpfs_lookparent,
+};
+
+////////////////////////////////////////////////////////////
+//
+// Filesystem operations
+
+static
+int
+tmpfs_sync(struct fs *fs)
+{
+	(void)fs;
+	return 0;
+}
+
+static
+const char *
+tmpfs_getvolname(struct fs *fs)
+{
+	struct tmpfs *tf = fs->fs_data;
+	return tf->tf_volname;
+}
+
+static
+struct vnode *
+tmpfs_getroot(struct fs *fs)
+{
+	struct tmpfs *tf = fs->fs_data;
+
+	VOP_INCREF(&tf->tf_root.tn_vnode);
+	return &tf->tf_root.tn_vnode;
+}
+
+static
+int
+tmpfs_unmount(struct fs *fs)
+{
+	/* Memory filesystems have nowhere to flush to; refuse. */
+	(void)fs;
+	return EBUSY;
+}
+
+/*
+ * Is V a tmpfs file? tmpfs does its I/O through page_lock, so its files
+ * cannot back a vmobject, whose vnode I/O is issued with page_lock held.
+ */
+int
+tmpfs_isfile(struct vnode *v)
+{
+	return v->vn_ops == &tmpfs_fileops;
+}
+
+/*
+ * Create a tmpfs and attach it under the name VOLNAME, so that paths
+ * like "VOLNAME:foo" refer to it. Called from the mount menu command.
+ */
+int
+tmpfs_mount(const char *volname)
+{
+	struct tmpfs *tf;
+	int result;
+
+	tf = kmalloc(sizeof(struct tmpfs));
+	if (tf == NULL) {
+		return ENOMEM;
+	}
+
+	tf->tf_volname = kstrdup(volname);
+	tf->tf_lock = lock_create("tmpfs");
+	if (tf->tf_volname == NULL || tf->tf_lock == NULL) {
+		goto fail;
+	}
+	tf->tf_files = NULL;
+
+	tf->tf_fs.fs_sync = tmpfs_sync;
+	tf->tf_fs.fs_getvolname = tmpfs_getvolname;
+	tf->tf_fs.fs_getroot = tmpfs_getroot;
+	tf->tf_fs.fs_unmount = tmpfs_unmount;
+	tf->tf_fs.fs_data = tf;
+
+	strcpy(tf->tf_root.tn_name, "");
+	tf->tf_root.tn_isdir = 1;
+	tf->tf_root.tn_linked = 1;
+	tf->tf_root.tn_size = 0;
+	tf->tf_root.tn_obj = NULL;
+	tf->tf_root.tn_next = NULL;
+	result = vnode_init(&tf->tf_root.tn_vnode, &tmpfs_dirops,
+			    &tf->tf_fs, &tf->tf_root);
+	if (result) {
+		goto fail;
+	}
+
+	result = vfs_addfs(volname, &tf->tf_fs);
+	if (result) {
+		vnode_cleanup(&tf->tf_root.tn_vnode);
+		goto fail2;
+	}
+
+	return 0;
+
+ fail:
+	result = ENOMEM;
+ fail2:
+	if (tf->tf_lock != NULL) {
+		lock_destroy(tf->tf_lock);
+	}
+	if (tf->tf_volname != NULL) {
+		kfree(tf->tf_volname);
+	}
+	kfree(tf);
+	return result;
+}
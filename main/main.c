@@ -22,6 +22,7 @@
 #include <version.h>
 #include <addrspace.h>
 #include <clock.h>
+#include <pid.h>
 
 /*
  * These two pieces of data are maintained by the makefiles and build system.
@@ -87,17 +88,25 @@ boot(void)
 	vfs_setbootfs("emu0");
 
 
-	if(firstbigswap == 0){
-		firstbigswap = 1;		
-		char path[] = "lhd0raw:";
-		int result = vfs_open(path, O_RDWR, &bigswap); 
-		
-		struct stat stat;
-		VOP_STAT(bigswap, &stat);
-		kprintf("Pages available for swapping: %d\n", stat.st_size/PAGE_SIZE);
-		assert(result == 0);
+	/*
+	 * Swap on lhd0. Other disks may hold filesystems, so they are
+	 * only used for swap when asked for with the swapon command,
+	 * from the menu or on the boot command line
+	 * (e.g. "swapon lhd1raw:;swapon lhd2raw:").
+	 */
+	{
+		int result;
+
+		result = swap_adddev("lhd0raw:");
+		if (result) {
+			panic("swap: cannot open lhd0raw: (%s)\n",
+			      strerror(result));
+		}
 	}
 
+	vm_startdaemons();
+	snapshot_bootstrap();
+
 	/*
 	 * Make sure various things aren't screwed up.
 	 */
@@ -175,28 +184,10 @@ int
 kmain(char *arguments)
 {
 	boot();
-	int i;
-
-	pidCounter = 10;
-	pidcount = sem_create("pidcount", 1);
-
-    i = 0;
-	exitcodes = (int *)kmalloc(sizeof(int) * 1000);
-	parents = (int *)kmalloc(sizeof(int) * 1000);        
-	threadarray = (struct thread **)kmalloc(sizeof(struct thread*) * 1000); 
-    if (threadarray == NULL || exitcodes == NULL || parents == NULL){
-        return 0;
-    }
-    
-    for(i = 0; i < 1000; i++){
-        threadarray[i] = NULL;
-        exitcodes[i] = -1;
-        parents[i] = -1;
-    }
-    threadarray[0] = curthread;
-    parents[0] = 0;
-    curthread->pid = 0;
-    curthread->active = 1;
+
+	/* The menu thread is process 0. */
+	pid_bootstrap();
+	curthread->active = 1;
         
 	menu(arguments);
 
@@ -9,16 +9,21 @@
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
+#include <synch.h>
+#include <scheduler.h>
 #include <syscall.h>
 #include <uio.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <tmpfs.h>
 #include <test.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include <curthread.h>
 #include <addrspace.h>
+#include <vm.h>
+#include <pid.h>
 
 #define _PATH_SHELL "/bin/sh"
 
@@ -70,19 +75,24 @@ cmd_progthread(void *ptr, unsigned long nargs)
 	struct box * cargo = (struct box *)nargs; 
     curthread->t_vmspace = cargo->as; 
 
-	curthread->pid = cargo->pid;
+	pid_alloc(curthread, cargo->parent);
     curthread->active = 1;
-    parents[cargo->pid] = cargo->parent;
 
 	int temp = cargo->active;
 	nargs = temp;
-
-	threadarray[curthread->pid] = curthread;
 	*/
 	/* Hope we fit. */
 	assert(strlen(args[0]) < sizeof(progname));
 
 	strcpy(progname, args[0]);
+
+	/* A pid, so setpriority/settickets/waitpid can name the program. */
+	result = pid_alloc(curthread, 0);
+	if (result) {
+		kprintf("Running program %s failed: %s\n", args[0],
+			strerror(result));
+		return;
+	}
         
 	result = runprogram(progname, args);
 	if (result) {
@@ -97,14 +107,9 @@ cmd_progthread(void *ptr, unsigned long nargs)
 /*
  * Common code for cmd_prog and cmd_shell.
  *
- * Note that this does not wait for the subprogram to finish, but
- * returns immediately to the menu. This is usually not what you want,
- * so you should have it call your system-calls-assignment waitpid
- * code after forking.
- *
- * Also note that because the subprogram's thread uses the "args"
- * array and strings, until you do this a race condition exists
- * between that code and the menu input code.
+ * The menu sleeps in thread_join until the subprogram exits, which
+ * also keeps the "args" array and strings, which the subprogram's
+ * thread uses, alive until it is done with them.
  */
 static
 int
@@ -117,7 +122,7 @@ common_prog(int nargs, char **args)
 	kprintf("Warning: this probably won't work with a "
 		"synchronization-problems kernel.\n");
 #endif
-	result = thread_fork(args[0] /* thread name */,
+	result = thread_fork_joinable(args[0] /* thread name */,
 			args /* thread arg */, nargs /* thread arg */,
 			cmd_progthread, &thread);
 	if (result) {
@@ -125,7 +130,7 @@ common_prog(int nargs, char **args)
 		return result;
 	}
 
-	return thread_join(thread);
+	return thread_join(thread, NULL);
 }
 
 /*
@@ -268,6 +273,7 @@ static const struct {
 #if OPT_SFS
 	{ "sfs", sfs_mount },
 #endif
+	{ "tmpfs", tmpfs_mount },
 	{ NULL, NULL }
 };
 
@@ -363,6 +369,273 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for compacting physical memory: "compact npages" tries to
+ * gather that many free frames into one contiguous run.
+ */
+static
+int
+cmd_compact(int nargs, char **args)
+{
+	int npages, index;
+
+	if (nargs != 2 || (npages = atoi(args[1])) < 1) {
+		kprintf("Usage: compact npages\n");
+		return EINVAL;
+	}
+
+	lock_acquire(page_lock);
+	index = findavailablerun(npages);
+	if (index == 0) {
+		/* we hold page_lock and touch no user pages: safe to move */
+		index = compact_window(npages);
+	}
+	lock_release(page_lock);
+
+	if (index == 0) {
+		kprintf("compact: no run of %d free frames\n", npages);
+	}
+	else {
+		kprintf("compact: %d free frames at 0x%x\n", npages,
+			index * PAGE_SIZE);
+	}
+	vm_printstats();
+	return 0;
+}
+
+/*
+ * Command for same-page merging: "ksm on", "ksm off", or just "ksm"
+ * to print the merge statistics.
+ */
+static
+int
+cmd_ksm(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		result = ksm_enable(1);
+		if (result) {
+			kprintf("ksm: %s\n", strerror(result));
+			return result;
+		}
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		ksm_enable(0);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: ksm [on|off]\n");
+		return EINVAL;
+	}
+
+	ksm_printstats();
+	return 0;
+}
+
+/*
+ * Command for process snapshots: "snap" lists them, "snap run name [n]"
+ * starts n processes from one and waits for them, "snap rm name" drops
+ * one. Snapshots are taken by the process itself with snapshot().
+ */
+static
+int
+cmd_snap(int nargs, char **args)
+{
+	struct thread *threads[16];
+	time_t beforesecs, aftersecs, secs;
+	u_int32_t beforensecs, afternsecs, nsecs;
+	int i, n, result;
+
+	if (nargs == 1) {
+		snapshot_printstats();
+		return 0;
+	}
+	if (nargs == 3 && !strcmp(args[1], "rm")) {
+		result = snapshot_delete(args[2]);
+		if (result) {
+			kprintf("snap: %s: %s\n", args[2], strerror(result));
+		}
+		return result;
+	}
+	if ((nargs != 3 && nargs != 4) || strcmp(args[1], "run")) {
+		kprintf("Usage: snap [run name [n] | rm name]\n");
+		return EINVAL;
+	}
+
+	n = nargs == 4 ? atoi(args[3]) : 1;
+	if (n < 1 || n > 16) {
+		kprintf("snap: n must be between 1 and 16\n");
+		return EINVAL;
+	}
+
+	gettime(&beforesecs, &beforensecs);
+	for (i = 0; i < n; i++) {
+		result = snapshot_spawn(args[2], &threads[i]);
+		if (result) {
+			kprintf("snap: %s: %s\n", args[2], strerror(result));
+			break;
+		}
+	}
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+	kprintf("snap: started %d process(es) in %lu.%09lu seconds\n", i,
+		(unsigned long) secs, (unsigned long) nsecs);
+
+	n = i;
+	for (i = 0; i < n; i++) {
+		thread_join(threads[i], NULL);
+	}
+	return 0;
+}
+
+/*
+ * Command for dumping the scheduler's run queues and the wakeup
+ * statistics of the synchronization primitives and timers.
+ */
+static
+int
+cmd_runqueues(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	print_run_queue();
+	synch_printstats();
+	timer_printstats();
+	pid_printstats();
+	return 0;
+}
+
+/*
+ * Command for choosing the scheduling policy: "sched mlfq" or
+ * "sched stride".
+ */
+static
+int
+cmd_sched(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "mlfq")) {
+		scheduler_setpolicy(SCHED_MLFQ);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "stride")) {
+		scheduler_setpolicy(SCHED_STRIDE);
+	}
+	else {
+		kprintf("Usage: sched mlfq|stride\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Command for setting the scheduler's base quantum, in clock ticks.
+ */
+static
+int
+cmd_quantum(int nargs, char **args)
+{
+	int ticks;
+
+	ticks = nargs == 2 ? atoi(args[1]) : 0;
+	if (ticks < 1 || ticks > SCHED_MAXQUANTUM) {
+		kprintf("Usage: quantum ticks (1-%d)\n", SCHED_MAXQUANTUM);
+		return EINVAL;
+	}
+	scheduler_setquantum(ticks);
+	return 0;
+}
+
+/*
+ * Command for switching to a thread we just woke when going to sleep:
+ * "handoff on", "handoff off", or just "handoff" for the statistics.
+ */
+static
+int
+cmd_handoff(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		thread_sethandoff(1);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		thread_sethandoff(0);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: handoff [on|off]\n");
+		return EINVAL;
+	}
+	thread_printstats();
+	return 0;
+}
+
+/*
+ * Command for TLB save/restore across context switches: "tlb on",
+ * "tlb off", or just "tlb" to print the refill statistics.
+ */
+static
+int
+cmd_tlb(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		tlb_setsnapshots(1);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		tlb_setsnapshots(0);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: tlb [on|off]\n");
+		return EINVAL;
+	}
+
+	tlb_printstats();
+	return 0;
+}
+
+/*
+ * Command for swap devices: "swapon device:" adds another raw disk,
+ * "swapon rr" or "swapon depth" picks how new slots are spread over
+ * the devices, and plain "swapon" prints the per-device statistics.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "rr")) {
+		swap_setpolicy(SWAP_ROUNDROBIN);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "depth")) {
+		swap_setpolicy(SWAP_QDEPTH);
+	}
+	else if (nargs == 2) {
+		result = swap_adddev(args[1]);
+		if (result) {
+			kprintf("swapon: %s: %s\n", args[1], strerror(result));
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: swapon [device:|rr|depth]\n");
+		return EINVAL;
+	}
+
+	swap_printstats();
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -439,6 +712,10 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[pb]  Pipe flip/copy benchmark      ",
+	"[sb]  Stride share benchmark        ",
+	"[pp]  Semaphore ping-pong benchmark ",
+	"[jb]  Blocking join benchmark       ",
 	NULL
 };
 
@@ -550,6 +827,16 @@ static const char *mainmenu[] = {
 	"[1c] Stoplight                      ",
 #endif
 	"[kh] Kernel heap stats              ",
+	"[vm] VM stats                       ",
+	"[compact] Compact physical memory   ",
+	"[ksm] Same-page merging [on|off]    ",
+	"[swapon] Swap devices [dev|rr|depth]",
+	"[tlb] TLB save/restore [on|off]     ",
+	"[snap] Process snapshots [run|rm]   ",
+	"[rq] Scheduler run queues           ",
+	"[sched] Scheduler [mlfq|stride]     ",
+	"[handoff] Sleep hand-off [on|off]   ",
+	"[quantum] Scheduler quantum [ticks] ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -605,6 +892,16 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "vm",		cmd_vmstats },
+	{ "compact",	cmd_compact },
+	{ "ksm",	cmd_ksm },
+	{ "swapon",	cmd_swapon },
+	{ "tlb",	cmd_tlb },
+	{ "snap",	cmd_snap },
+	{ "rq",		cmd_runqueues },
+	{ "sched",	cmd_sched },
+	{ "handoff",	cmd_handoff },
+	{ "quantum",	cmd_quantum },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -631,6 +928,14 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
 
+	/* vm benchmarks */
+	{ "pb",		pipebench },
+
+	/* scheduler benchmarks */
+	{ "sb",		stridebench },
+	{ "pp",		pingpongbench },
+	{ "jb",		joinbench },
+
         
         /* dbflags options*/
         { "df",         updateDB },
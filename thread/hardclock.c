@@ -1,8 +1,11 @@
 #include <types.h>
 #include <lib.h>
+#include <kern/errno.h>
 #include <machine/spl.h>
 #include <thread.h>
+#include <scheduler.h>
 #include <clock.h>
+#include <syscall.h>
 
 /* 
  * The address of lbolt has thread_wakeup called on it once a second.
@@ -11,6 +14,201 @@ int lbolt;
 
 static int lbolt_counter;
 
+/*
+ * Timer wheel.
+ *
+ * Armed timers hang off one of three wheels of TW_SIZE slots. Level 0
+ * has a slot per tick for the next TW_SIZE ticks; each slot of level 1
+ * covers TW_SIZE ticks, and each slot of level 2 TW_SIZE*TW_SIZE. Every
+ * tick runs the current level-0 slot. When level 0 wraps, the next
+ * level-1 slot is cascaded down into it (and likewise level 2 into
+ * level 1), so a timer is moved at most twice and each tick does a
+ * constant amount of work apart from the timers that actually expire.
+ * Timers further out than the wheels reach are parked in the last
+ * level-2 slot and re-cascaded until they come within range.
+ *
+ * Everything runs at splhigh; callbacks run from hardclock.
+ */
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 3
+#define TW_RANGE ((u_int32_t)1 << (TW_BITS * TW_LEVELS))
+
+static struct timer *wheel[TW_LEVELS][TW_SIZE];
+
+/* ticks since boot */
+static volatile u_int32_t timer_ticks;
+
+/* statistics */
+static unsigned long timer_fired;
+static unsigned long timer_cancelled;
+static unsigned long timer_cascaded;
+
+u_int32_t
+timer_now(void)
+{
+	return timer_ticks;
+}
+
+void
+timer_init(struct timer *tm, void (*func)(void *), void *data)
+{
+	tm->tm_func = func;
+	tm->tm_data = data;
+	tm->tm_slot = NULL;
+	tm->tm_next = tm->tm_prev = NULL;
+}
+
+/*
+ * Hang TM in the slot for its expiry time.
+ */
+static
+void
+timer_link(struct timer *tm)
+{
+	u_int32_t delta = tm->tm_expires - timer_ticks;
+	struct timer **slot;
+
+	if ((int32_t)delta <= 0) {
+		/* due now (from a cascade): the slot timer_tick runs next */
+		slot = &wheel[0][timer_ticks & TW_MASK];
+	}
+	else if (delta < TW_SIZE) {
+		slot = &wheel[0][tm->tm_expires & TW_MASK];
+	}
+	else if (delta < TW_SIZE * TW_SIZE) {
+		slot = &wheel[1][(tm->tm_expires >> TW_BITS) & TW_MASK];
+	}
+	else if (delta < TW_RANGE) {
+		slot = &wheel[2][(tm->tm_expires >> (2*TW_BITS)) & TW_MASK];
+	}
+	else {
+		/* out of range: park it as far out as we can see */
+		slot = &wheel[2][((timer_ticks + TW_RANGE - 1) >> (2*TW_BITS))
+				 & TW_MASK];
+	}
+
+	tm->tm_slot = slot;
+	tm->tm_prev = NULL;
+	tm->tm_next = *slot;
+	if (*slot != NULL) {
+		(*slot)->tm_prev = tm;
+	}
+	*slot = tm;
+}
+
+static
+void
+timer_unlink(struct timer *tm)
+{
+	if (tm->tm_prev == NULL) {
+		*tm->tm_slot = tm->tm_next;
+	}
+	else {
+		tm->tm_prev->tm_next = tm->tm_next;
+	}
+	if (tm->tm_next != NULL) {
+		tm->tm_next->tm_prev = tm->tm_prev;
+	}
+	tm->tm_slot = NULL;
+	tm->tm_next = tm->tm_prev = NULL;
+}
+
+/*
+ * Arm TM to fire TICKS ticks from now (at least one).
+ */
+void
+timer_add(struct timer *tm, u_int32_t ticks)
+{
+	int spl = splhigh();
+
+	assert(tm->tm_slot == NULL);
+	if (ticks == 0) {
+		ticks = 1;
+	}
+	tm->tm_expires = timer_ticks + ticks;
+	timer_link(tm);
+	splx(spl);
+}
+
+/*
+ * Disarm TM. Returns nonzero if it was still pending.
+ */
+int
+timer_del(struct timer *tm)
+{
+	int spl = splhigh();
+	int pending = tm->tm_slot != NULL;
+
+	if (pending) {
+		timer_unlink(tm);
+		timer_cancelled++;
+	}
+	splx(spl);
+	return pending;
+}
+
+/*
+ * Move every timer in slot INDEX of level LEVEL down to where it
+ * belongs now.
+ */
+static
+void
+timer_cascade(int level, int index)
+{
+	struct timer *tm, *next;
+
+	tm = wheel[level][index];
+	wheel[level][index] = NULL;
+	for (; tm != NULL; tm = next) {
+		next = tm->tm_next;
+		timer_link(tm);
+		timer_cascaded++;
+	}
+}
+
+/*
+ * Advance the wheel by one tick and run whatever expires.
+ */
+static
+void
+timer_tick(void)
+{
+	struct timer *tm;
+	int index;
+
+	timer_ticks++;
+	index = timer_ticks & TW_MASK;
+
+	if (index == 0) {
+		int index1 = (timer_ticks >> TW_BITS) & TW_MASK;
+
+		if (index1 == 0) {
+			timer_cascade(2, (timer_ticks >> (2*TW_BITS)) & TW_MASK);
+		}
+		timer_cascade(1, index1);
+	}
+
+	while ((tm = wheel[0][index]) != NULL) {
+		timer_unlink(tm);
+		if ((int32_t)(tm->tm_expires - timer_ticks) > 0) {
+			/* parked out-of-range timer that is still not due */
+			timer_link(tm);
+			continue;
+		}
+		timer_fired++;
+		tm->tm_func(tm->tm_data);
+	}
+}
+
+void
+timer_printstats(void)
+{
+	kprintf("timers: tick %u, %lu fired, %lu cancelled, %lu cascaded\n",
+		timer_ticks, timer_fired, timer_cancelled, timer_cascaded);
+}
+
 /*
  * This is called HZ times a second by the timer device setup.
  */
@@ -23,13 +221,26 @@ hardclock(void)
 	 */
 
 
+	timer_tick();
+
 	lbolt_counter++;
 	if (lbolt_counter >= HZ) {
 		lbolt_counter = 0;
 		thread_wakeup(&lbolt);
 	}
 
-	thread_yield();
+	/* Let the scheduler decide whether the current thread goes on. */
+	scheduler_tick();
+}
+
+/*
+ * Convert a duration to clock ticks, rounding up so a sleep is never
+ * shorter than asked for.
+ */
+u_int32_t
+timer_ticksfor(time_t secs, u_int32_t nsecs)
+{
+	return secs * HZ + (nsecs / 1000 * HZ + 999999) / 1000000;
 }
 
 /*
@@ -47,3 +258,18 @@ clocksleep(int num_secs)
 	}
 	splx(s);
 }
+
+/*
+ * nanosleep() system call: sleep for SECS seconds plus NSECS
+ * nanoseconds, to the next clock tick.
+ */
+int
+sys_nanosleep(time_t secs, u_int32_t nsecs, int *retval)
+{
+	if (secs < 0 || nsecs >= 1000000000) {
+		return EINVAL;
+	}
+	thread_sleep_until(timer_now() + timer_ticksfor(secs, nsecs));
+	*retval = 0;
+	return 0;
+}
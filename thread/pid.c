@@ -0,0 +1,370 @@
+/*
+ * Process ids.
+ *
+ * Every process has a record in pidtable, indexed by pid, holding its
+ * thread, its parent, and once it has exited its exit code. Free pids
+ * are tracked in a bitmap, one bit per pid; pid_hint is the word the
+ * last allocation came from, so allocation normally finds a clear bit
+ * right away instead of scanning from 0. Freed pids are reused.
+ *
+ * When every pid is taken the table and bitmap double, up to PID_MAX.
+ * The table holds pointers to records, so a record (and the wait
+ * channel that is its address) stays put when the table grows.
+ *
+ * A record lives until its exit code is collected by the parent with
+ * pid_wait, or until it exits after its parent has. When a parent
+ * exits its children are orphaned: those that have already exited are
+ * freed then, the rest free themselves when they exit. Process 0, the
+ * kernel menu, never waits, so its children start out orphaned.
+ *
+ * Everything runs at splhigh.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <machine/spl.h>
+#include <thread.h>
+#include <curthread.h>
+#include <pid.h>
+
+#define PID_INITSIZE 64		/* must be a multiple of 32 */
+#define PID_NOPARENT (-1)
+
+struct pidinfo {
+	struct thread *pi_thread;	/* NULL once exited */
+	int pi_parent;			/* PID_NOPARENT if orphaned */
+	int pi_exited;
+	int pi_exitcode;
+	int pi_children;		/* first child */
+	int pi_sibling;			/* next child of the same parent */
+};
+
+static struct pidinfo **pidtable;
+static u_int32_t *pid_bits;
+static int pid_size;		/* entries in pidtable, bits in pid_bits */
+static int pid_hint;		/* word of pid_bits to search first */
+static int pid_inuse;
+
+/* statistics */
+static unsigned long pid_allocs;
+static unsigned long pid_grows;
+
+static
+void
+pid_setbit(int pid)
+{
+	pid_bits[pid/32] |= (u_int32_t)1 << (pid%32);
+}
+
+static
+void
+pid_clearbit(int pid)
+{
+	pid_bits[pid/32] &= ~((u_int32_t)1 << (pid%32));
+}
+
+/*
+ * Double the table, up to PID_MAX entries.
+ */
+static
+int
+pid_grow(void)
+{
+	struct pidinfo **newtable;
+	u_int32_t *newbits;
+	int newsize, i;
+
+	if (pid_size >= PID_MAX) {
+		return EAGAIN;
+	}
+	newsize = pid_size * 2;
+	if (newsize > PID_MAX) {
+		newsize = PID_MAX;
+	}
+
+	newtable = kmalloc(newsize * sizeof(struct pidinfo *));
+	newbits = kmalloc(newsize / 32 * sizeof(u_int32_t));
+	if (newtable == NULL || newbits == NULL) {
+		kfree(newtable);
+		kfree(newbits);
+		return ENOMEM;
+	}
+
+	for (i=0; i<newsize; i++) {
+		newtable[i] = i < pid_size ? pidtable[i] : NULL;
+	}
+	for (i=0; i<newsize/32; i++) {
+		newbits[i] = i < pid_size/32 ? pid_bits[i] : 0;
+	}
+	kfree(pidtable);
+	kfree(pid_bits);
+	pidtable = newtable;
+	pid_bits = newbits;
+
+	/* the new half is all free */
+	pid_hint = pid_size/32;
+	pid_size = newsize;
+	pid_grows++;
+	return 0;
+}
+
+/*
+ * Find a clear bit, starting at the hint word. Returns -1 if there is
+ * none.
+ */
+static
+int
+pid_findfree(void)
+{
+	int nwords = pid_size/32;
+	int i, w, bit;
+
+	for (i=0; i<nwords; i++) {
+		w = (pid_hint + i) % nwords;
+		if (pid_bits[w] != 0xffffffff) {
+			for (bit=0; pid_bits[w] & ((u_int32_t)1 << bit); bit++) {
+				/* nothing */
+			}
+			pid_hint = w;
+			return w*32 + bit;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Set up the table. The boot thread gets pid 0; pids below PID_MIN are
+ * never handed out.
+ */
+void
+pid_bootstrap(void)
+{
+	struct pidinfo *pi;
+	int i;
+
+	pidtable = kmalloc(PID_INITSIZE * sizeof(struct pidinfo *));
+	pid_bits = kmalloc(PID_INITSIZE / 32 * sizeof(u_int32_t));
+	pi = kmalloc(sizeof(struct pidinfo));
+	if (pidtable == NULL || pid_bits == NULL || pi == NULL) {
+		panic("pid_bootstrap: out of memory\n");
+	}
+	pid_size = PID_INITSIZE;
+	for (i=0; i<pid_size; i++) {
+		pidtable[i] = NULL;
+	}
+	for (i=0; i<pid_size/32; i++) {
+		pid_bits[i] = 0;
+	}
+	for (i=0; i<PID_MIN; i++) {
+		pid_setbit(i);
+	}
+
+	pi->pi_thread = curthread;
+	pi->pi_parent = PID_NOPARENT;
+	pi->pi_exited = 0;
+	pi->pi_exitcode = 0;
+	pi->pi_children = PID_NOPARENT;
+	pi->pi_sibling = PID_NOPARENT;
+	pidtable[0] = pi;
+	pid_inuse = 1;
+	curthread->pid = 0;
+}
+
+/*
+ * Give thread T a pid, as a child of process PARENT (PID_NOPARENT or 0
+ * for none). Sets t->pid.
+ */
+int
+pid_alloc(struct thread *t, int parent)
+{
+	struct pidinfo *pi;
+	int spl, pid, result;
+
+	pi = kmalloc(sizeof(struct pidinfo));
+	if (pi == NULL) {
+		return ENOMEM;
+	}
+
+	spl = splhigh();
+	pid = pid_findfree();
+	if (pid < 0) {
+		result = pid_grow();
+		if (result) {
+			splx(spl);
+			kfree(pi);
+			return result;
+		}
+		pid = pid_findfree();
+		assert(pid >= 0);
+	}
+	pid_setbit(pid);
+
+	pi->pi_thread = t;
+	pi->pi_exited = 0;
+	pi->pi_exitcode = 0;
+	pi->pi_children = PID_NOPARENT;
+	pi->pi_sibling = PID_NOPARENT;
+	if (parent > 0 && parent < pid_size && pidtable[parent] != NULL &&
+	    !pidtable[parent]->pi_exited) {
+		pi->pi_parent = parent;
+		pi->pi_sibling = pidtable[parent]->pi_children;
+		pidtable[parent]->pi_children = pid;
+	}
+	else {
+		pi->pi_parent = PID_NOPARENT;
+	}
+	pidtable[pid] = pi;
+	pid_inuse++;
+	pid_allocs++;
+
+	t->pid = pid;
+	splx(spl);
+	return 0;
+}
+
+/* Called at splhigh. */
+static
+struct pidinfo *
+pid_lookup(int pid)
+{
+	if (pid < 0 || pid >= pid_size) {
+		return NULL;
+	}
+	return pidtable[pid];
+}
+
+/*
+ * Take PID off its parent's list of children.
+ */
+static
+void
+pid_unlink(int pid)
+{
+	struct pidinfo *pi = pidtable[pid];
+	struct pidinfo *parent;
+	int *prev;
+
+	if (pi->pi_parent == PID_NOPARENT) {
+		return;
+	}
+	parent = pidtable[pi->pi_parent];
+	for (prev = &parent->pi_children; *prev != pid;
+	     prev = &pidtable[*prev]->pi_sibling) {
+		assert(*prev != PID_NOPARENT);
+	}
+	*prev = pi->pi_sibling;
+}
+
+/*
+ * Free PID's record and make the pid available again.
+ */
+static
+void
+pid_free(int pid)
+{
+	struct pidinfo *pi = pidtable[pid];
+
+	pid_unlink(pid);
+	pidtable[pid] = NULL;
+	pid_clearbit(pid);
+	pid_inuse--;
+	kfree(pi);
+}
+
+/*
+ * The running thread of PID, or NULL if there is none.
+ */
+struct thread *
+pid_getthread(int pid)
+{
+	struct pidinfo *pi;
+	struct thread *t;
+	int spl;
+
+	spl = splhigh();
+	pi = pid_lookup(pid);
+	t = pi == NULL ? NULL : pi->pi_thread;
+	splx(spl);
+	return t;
+}
+
+/*
+ * Process PID exits with CODE. Wakes up a parent waiting for it, or
+ * frees the record right away if nobody can wait for it any more.
+ * Its own children become orphans.
+ */
+void
+pid_exit(int pid, int code)
+{
+	struct pidinfo *pi, *child;
+	int spl, c, next;
+
+	spl = splhigh();
+	pi = pid_lookup(pid);
+	assert(pi != NULL && !pi->pi_exited);
+
+	for (c = pi->pi_children; c != PID_NOPARENT; c = next) {
+		child = pidtable[c];
+		next = child->pi_sibling;
+		child->pi_parent = PID_NOPARENT;
+		child->pi_sibling = PID_NOPARENT;
+		if (child->pi_exited) {
+			pid_free(c);
+		}
+	}
+	pi->pi_children = PID_NOPARENT;
+
+	pi->pi_thread = NULL;
+	pi->pi_exitcode = code;
+	pi->pi_exited = 1;
+
+	if (pi->pi_parent == PID_NOPARENT) {
+		pid_free(pid);
+	}
+	else {
+		thread_wakeup(pi);
+	}
+	splx(spl);
+}
+
+/*
+ * Wait for child PID of process PARENT to exit, put its exit code in
+ * *CODE, and free the pid.
+ */
+int
+pid_wait(int pid, int parent, int *code)
+{
+	struct pidinfo *pi;
+	int spl;
+
+	spl = splhigh();
+	pi = pid_lookup(pid);
+	if (pi == NULL) {
+		splx(spl);
+		return ESRCH;
+	}
+	if (pi->pi_parent != parent || pid == parent) {
+		splx(spl);
+		return EINVAL;
+	}
+
+	/* the record cannot go away while its parent is waiting in it */
+	while (!pi->pi_exited) {
+		thread_sleep(pi);
+	}
+	*code = pi->pi_exitcode;
+	pid_free(pid);
+	splx(spl);
+	return 0;
+}
+
+void
+pid_printstats(void)
+{
+	int spl = splhigh();
+
+	kprintf("pids: %d in use, table size %d, %lu allocated, "
+		"%lu grows\n", pid_inuse, pid_size, pid_allocs, pid_grows);
+	splx(spl);
+}
@@ -1,23 +1,91 @@
 /*
  * Scheduler.
  *
- * The default scheduler is very simple, just a round-robin run queue.
- * You'll want to improve it.
+ * Multi-level feedback queue. There are SCHED_NLEVELS run queues; level
+ * 0 is the highest priority and has the shortest quantum. scheduler()
+ * always runs the first thread of the highest non-empty level.
+ *
+ *   - A thread that uses up its quantum drops one level (scheduler_tick).
+ *   - A thread woken from sleep, i.e. one that was waiting for I/O or
+ *     another thread rather than computing, moves up one level
+ *     (scheduler_wakeup).
+ *   - Every SCHED_AGING ticks every thread goes back to its base level,
+ *     so CPU-bound threads at the bottom cannot starve.
+ *
+ * The base level is the highest a thread can be boosted to. It is 0
+ * unless set with setpriority().
+ *
+ * Alternatively (scheduler_setpolicy(SCHED_STRIDE), or "sched stride"
+ * at boot) threads are scheduled by stride: each has t_tickets and a
+ * stride of STRIDE1/t_tickets, the runnable threads are kept in a heap
+ * ordered by pass, the thread with the lowest pass runs, and every tick
+ * it runs adds its stride to its pass. Over time each thread gets CPU
+ * in proportion to its tickets.
  */
 
 #include <types.h>
 #include <lib.h>
+#include <kern/errno.h>
 #include <scheduler.h>
 #include <thread.h>
+#include <curthread.h>
 #include <machine/spl.h>
-#include <queue.h>
+#include <clock.h>
+#include <test.h>
+#include <syscall.h>
+#include <pid.h>
 
 /*
  *  Scheduler data
  */
 
-// Queue of runnable threads
-static struct queue *runqueue;
+/*
+ * Quantum of each level, in hardclock ticks: the base quantum at level
+ * 0, doubling at each level below. Set with scheduler_setquantum. The
+ * stride policy uses the base quantum.
+ */
+static int sched_basequantum = 1;
+static int sched_quantum[SCHED_NLEVELS] = { 1, 2, 4, 8 };
+
+/* Ticks between anti-starvation boosts. */
+#define SCHED_AGING HZ
+
+/*
+ * A run queue is a list linked through t_rqnext/t_rqprev in the
+ * threads themselves, so queueing a thread never allocates and never
+ * fails. A thread is on at most one run queue at a time.
+ *
+ * The stride queue uses the same links as a pairing heap instead:
+ * rq_head is the root, t_rqchild is a thread's first child, t_rqnext
+ * its next sibling, and t_rqprev its previous sibling, or its parent if
+ * it is a first child. rq_tail is unused.
+ */
+struct runqueue {
+	struct thread *rq_head;
+	struct thread *rq_tail;
+	int rq_count;
+};
+
+// Queues of runnable threads, one per level
+static struct runqueue runqueues[SCHED_NLEVELS];
+
+static int sched_policy = SCHED_MLFQ;
+
+/* Stride scheduling: runnable threads in a heap ordered by pass. */
+#define STRIDE1 (1<<20)
+
+static struct runqueue stride_queue;
+static u_int32_t stride_globalpass;	/* pass of the last thread picked */
+
+static int sched_agingticks;
+
+/* statistics */
+static unsigned long sched_demotions;
+static unsigned long sched_promotions;
+static unsigned long sched_preemptions;
+static unsigned long sched_boosts;
+static unsigned long sched_expiries;	/* quantum used up, switched away */
+static unsigned long sched_kept;	/* quantum used up, nothing else to run */
 
 /*
  * Setup function
@@ -25,24 +93,266 @@ static struct queue *runqueue;
 void
 scheduler_bootstrap(void)
 {
-	runqueue = q_create(32);
-	if (runqueue == NULL) {
-		panic("scheduler: Could not create run queue\n");
+	int i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		runqueues[i].rq_head = runqueues[i].rq_tail = NULL;
+		runqueues[i].rq_count = 0;
 	}
+	stride_queue.rq_head = stride_queue.rq_tail = NULL;
+	stride_queue.rq_count = 0;
 }
 
 /*
  * Ensure space for handling at least NTHREADS threads.
- * This is done only to ensure that make_runnable() does not fail -
- * if you change the scheduler to not require space outside the 
- * thread structure, for instance, this function can reasonably
- * do nothing.
+ * The run queues are linked through the thread structures, so there
+ * is nothing to allocate.
  */
 int
 scheduler_preallocate(int nthreads)
 {
-	assert(curspl>0);
-	return q_preallocate(runqueue, nthreads);
+	(void)nthreads;
+	return 0;
+}
+
+static
+int
+rq_empty(struct runqueue *rq)
+{
+	return rq->rq_head == NULL;
+}
+
+/*
+ * Link T into RQ after AFTER, or at the head if AFTER is NULL.
+ */
+static
+void
+rq_insertafter(struct runqueue *rq, struct thread *after, struct thread *t)
+{
+	t->t_runqueue = rq;
+	t->t_rqprev = after;
+	if (after == NULL) {
+		t->t_rqnext = rq->rq_head;
+		rq->rq_head = t;
+	}
+	else {
+		t->t_rqnext = after->t_rqnext;
+		after->t_rqnext = t;
+	}
+	if (t->t_rqnext == NULL) {
+		rq->rq_tail = t;
+	}
+	else {
+		t->t_rqnext->t_rqprev = t;
+	}
+	rq->rq_count++;
+}
+
+static
+void
+rq_addtail(struct runqueue *rq, struct thread *t)
+{
+	rq_insertafter(rq, rq->rq_tail, t);
+}
+
+/*
+ * Unlink T from the run queue it is on.
+ */
+static
+void
+rq_remove(struct thread *t)
+{
+	struct runqueue *rq = t->t_runqueue;
+
+	assert(rq != NULL);
+	if (t->t_rqprev == NULL) {
+		rq->rq_head = t->t_rqnext;
+	}
+	else {
+		t->t_rqprev->t_rqnext = t->t_rqnext;
+	}
+	if (t->t_rqnext == NULL) {
+		rq->rq_tail = t->t_rqprev;
+	}
+	else {
+		t->t_rqnext->t_rqprev = t->t_rqprev;
+	}
+	t->t_rqnext = t->t_rqprev = NULL;
+	t->t_runqueue = NULL;
+	rq->rq_count--;
+}
+
+static
+struct thread *
+rq_remhead(struct runqueue *rq)
+{
+	struct thread *t = rq->rq_head;
+
+	assert(t != NULL);
+	rq_remove(t);
+	return t;
+}
+
+/*
+ * Pass values wrap around, so compare them by signed difference.
+ */
+static
+int
+stride_before(struct thread *a, struct thread *b)
+{
+	return (int32_t)(a->t_pass - b->t_pass) < 0;
+}
+
+/*
+ * Join two detached heaps, returning the new root. The root of the
+ * other becomes the first child of whichever root has the lower pass;
+ * A wins ties, so a thread queued earlier stays ahead of one with the
+ * same pass queued later.
+ */
+static
+struct thread *
+stride_meld(struct thread *a, struct thread *b)
+{
+	struct thread *t;
+
+	if (a == NULL) {
+		return b;
+	}
+	if (b == NULL) {
+		return a;
+	}
+	if (stride_before(b, a)) {
+		t = a;
+		a = b;
+		b = t;
+	}
+	b->t_rqprev = a;
+	b->t_rqnext = a->t_rqchild;
+	if (a->t_rqchild != NULL) {
+		a->t_rqchild->t_rqprev = b;
+	}
+	a->t_rqchild = b;
+	return a;
+}
+
+/*
+ * Meld a list of sibling heaps into one: pair them up left to right,
+ * then fold the pairs together right to left. Returns the new root.
+ */
+static
+struct thread *
+stride_mergepairs(struct thread *first)
+{
+	struct thread *a, *b, *pairs, *root;
+
+	/* first pass; the melded pairs are stacked through t_rqnext */
+	pairs = NULL;
+	while (first != NULL) {
+		a = first;
+		b = a->t_rqnext;
+		first = b == NULL ? NULL : b->t_rqnext;
+		a->t_rqnext = a->t_rqprev = NULL;
+		if (b != NULL) {
+			b->t_rqnext = b->t_rqprev = NULL;
+		}
+		a = stride_meld(a, b);
+		a->t_rqnext = pairs;
+		pairs = a;
+	}
+
+	/* second pass, starting from the last pair */
+	root = NULL;
+	while (pairs != NULL) {
+		a = pairs;
+		pairs = a->t_rqnext;
+		a->t_rqnext = NULL;
+		root = stride_meld(root, a);
+	}
+	return root;
+}
+
+/*
+ * Queue T in the stride heap. O(1).
+ */
+static
+void
+stride_push(struct thread *t)
+{
+	t->t_runqueue = &stride_queue;
+	t->t_rqchild = t->t_rqnext = t->t_rqprev = NULL;
+	stride_queue.rq_head = stride_meld(stride_queue.rq_head, t);
+	stride_queue.rq_count++;
+}
+
+/*
+ * Take T, which may be anywhere in the stride heap, out of it; its
+ * children are melded back in. O(log n) amortized.
+ */
+static
+void
+stride_remove(struct thread *t)
+{
+	struct thread *sub;
+
+	assert(t->t_runqueue == &stride_queue);
+
+	if (t == stride_queue.rq_head) {
+		stride_queue.rq_head = stride_mergepairs(t->t_rqchild);
+	}
+	else {
+		/* t_rqprev is the parent if T is its first child */
+		if (t->t_rqprev->t_rqchild == t) {
+			t->t_rqprev->t_rqchild = t->t_rqnext;
+		}
+		else {
+			t->t_rqprev->t_rqnext = t->t_rqnext;
+		}
+		if (t->t_rqnext != NULL) {
+			t->t_rqnext->t_rqprev = t->t_rqprev;
+		}
+		sub = stride_mergepairs(t->t_rqchild);
+		stride_queue.rq_head = stride_meld(stride_queue.rq_head, sub);
+	}
+	t->t_rqchild = t->t_rqnext = t->t_rqprev = NULL;
+	t->t_runqueue = NULL;
+	stride_queue.rq_count--;
+}
+
+/*
+ * Take the thread with the lowest pass out of the stride heap.
+ */
+static
+struct thread *
+stride_pop(void)
+{
+	struct thread *t = stride_queue.rq_head;
+
+	assert(t != NULL);
+	stride_remove(t);
+	return t;
+}
+
+/*
+ * Next thread after T in a preorder walk of the stride heap, or NULL.
+ */
+static
+struct thread *
+stride_walk(struct thread *t)
+{
+	if (t->t_rqchild != NULL) {
+		return t->t_rqchild;
+	}
+	while (t->t_rqnext == NULL) {
+		/* back to the first sibling, then up to the parent */
+		while (t->t_rqprev != NULL && t->t_rqprev->t_rqchild != t) {
+			t = t->t_rqprev;
+		}
+		t = t->t_rqprev;
+		if (t == NULL) {
+			return NULL;
+		}
+	}
+	return t->t_rqnext;
 }
 
 /*
@@ -54,28 +364,47 @@ scheduler_preallocate(int nthreads)
 void
 scheduler_killall(void)
 {
+	int i;
+
 	assert(curspl>0);
-	while (!q_empty(runqueue)) {
-		struct thread *t = q_remhead(runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		while (!rq_empty(&runqueues[i])) {
+			struct thread *t = rq_remhead(&runqueues[i]);
+			kprintf("scheduler: Dropping thread %s.\n", t->t_name);
+		}
+	}
+	while (!rq_empty(&stride_queue)) {
+		struct thread *t = stride_pop();
 		kprintf("scheduler: Dropping thread %s.\n", t->t_name);
 	}
 }
 
 /*
  * Cleanup function.
- *
- * The queue objects to being destroyed if it's got stuff in it.
- * Use scheduler_killall to make sure this is the case. During
- * ordinary shutdown, normally it should be.
  */
 void
 scheduler_shutdown(void)
 {
 	scheduler_killall();
-
 	assert(curspl>0);
-	q_destroy(runqueue);
-	runqueue = NULL;
+}
+
+/*
+ * Return the highest-priority level with a runnable thread, or
+ * SCHED_NLEVELS if there are none.
+ */
+static
+int
+scheduler_toplevel(void)
+{
+	int i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		if (!rq_empty(&runqueues[i])) {
+			break;
+		}
+	}
+	return i;
 }
 
 /*
@@ -87,10 +416,23 @@ scheduler_shutdown(void)
 struct thread *
 scheduler(void)
 {
+	int level;
+
 	// meant to be called with interrupts off
 	assert(curspl>0);
 	
-	while (q_empty(runqueue)) {
+	if (sched_policy == SCHED_STRIDE) {
+		struct thread *t;
+
+		while (rq_empty(&stride_queue)) {
+			cpu_idle();
+		}
+		t = stride_pop();
+		stride_globalpass = t->t_pass;
+		return t;
+	}
+
+	while ((level = scheduler_toplevel()) == SCHED_NLEVELS) {
 		cpu_idle();
 	}
 
@@ -101,24 +443,318 @@ scheduler(void)
 	// 
 	//print_run_queue();
 	
-	return q_remhead(runqueue);
+	return rq_remhead(&runqueues[level]);
 }
 
 /* 
- * Make a thread runnable.
- * With the base scheduler, just add it to the end of the run queue.
+ * Make a thread runnable: add it to the end of its level's queue.
+ * Never fails; the int return is kept for thread.c.
  */
 int
 make_runnable(struct thread *t)
 {
 	// meant to be called with interrupts off
 	assert(curspl>0);
+	assert(t->t_priority >= 0 && t->t_priority < SCHED_NLEVELS);
+
+	if (sched_policy == SCHED_STRIDE) {
+		/* A thread back from sleep must not make up for lost time. */
+		if ((int32_t)(t->t_pass - stride_globalpass) < 0) {
+			t->t_pass = stride_globalpass;
+		}
+		stride_push(t);
+		return 0;
+	}
+
+	rq_addtail(&runqueues[t->t_priority], t);
+	return 0;
+}
+
+/*
+ * Nonzero if T is waiting on a run queue.
+ */
+int
+scheduler_isqueued(struct thread *t)
+{
+	return t->t_runqueue != NULL;
+}
+
+/*
+ * Take runnable thread T off its run queue so the caller can switch
+ * to it directly. Returns EINVAL if T is not queued.
+ */
+int
+scheduler_remove(struct thread *t)
+{
+	assert(curspl>0);
+
+	if (t->t_runqueue == NULL) {
+		return EINVAL;
+	}
+	if (t->t_runqueue == &stride_queue) {
+		stride_remove(t);
+	}
+	else {
+		rq_remove(t);
+	}
+	return 0;
+}
+
+/*
+ * Called from thread_wakeup before a sleeping thread is made runnable.
+ * It gave up the CPU on its own, so move it up a level and give it a
+ * fresh quantum.
+ */
+void
+scheduler_wakeup(struct thread *t)
+{
+	assert(curspl>0);
+
+	if (t->t_priority > t->t_basepriority) {
+		t->t_priority--;
+		sched_promotions++;
+	}
+	t->t_ticks = 0;
+}
+
+/*
+ * Move every queued thread back to its base level. Called from
+ * scheduler_tick every SCHED_AGING ticks, with interrupts off.
+ */
+static
+void
+scheduler_age(void)
+{
+	struct thread *t;
+	int i, n;
+
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		n = runqueues[i].rq_count;
+		while (n-- > 0) {
+			t = rq_remhead(&runqueues[i]);
+			t->t_priority = t->t_basepriority;
+			t->t_ticks = 0;
+			rq_addtail(&runqueues[t->t_priority], t);
+		}
+	}
+	if (curthread != NULL) {
+		curthread->t_priority = curthread->t_basepriority;
+		curthread->t_ticks = 0;
+	}
+	sched_boosts++;
+}
+
+/*
+ * Nonzero if a thread other than the current one is waiting to run.
+ */
+static
+int
+scheduler_othersready(void)
+{
+	if (sched_policy == SCHED_STRIDE) {
+		return !rq_empty(&stride_queue);
+	}
+	return scheduler_toplevel() < SCHED_NLEVELS;
+}
+
+/*
+ * Called from hardclock on every tick. Charges the tick to the current
+ * thread. It is switched out when a higher priority thread is waiting
+ * (MLFQ), or when its quantum is used up and some other thread is
+ * ready to run. A thread alone on the CPU just gets a new quantum.
+ */
+void
+scheduler_tick(void)
+{
+	struct thread *cur = curthread;
+
+	assert(curspl>0);
+
+	if (sched_policy == SCHED_MLFQ &&
+	    ++sched_agingticks >= SCHED_AGING) {
+		sched_agingticks = 0;
+		scheduler_age();
+	}
+
+	if (cur == NULL) {
+		return;
+	}
 
-	return q_addtail(runqueue, t);
+	cur->t_ticks++;
+	cur->t_cputicks++;
+
+	if (sched_policy == SCHED_STRIDE) {
+		cur->t_pass += cur->t_stride;
+		if (cur->t_ticks < sched_basequantum) {
+			return;
+		}
+		cur->t_ticks = 0;
+		if (!rq_empty(&stride_queue) &&
+		    stride_before(stride_queue.rq_head, cur)) {
+			sched_expiries++;
+			cur->t_nivcsw++;
+			thread_yield();
+		}
+		else {
+			sched_kept++;
+		}
+		return;
+	}
+
+	if (cur->t_ticks >= sched_quantum[cur->t_priority]) {
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+			sched_demotions++;
+		}
+		cur->t_ticks = 0;
+		if (scheduler_othersready()) {
+			sched_expiries++;
+			cur->t_nivcsw++;
+			thread_yield();
+		}
+		else {
+			sched_kept++;
+		}
+	}
+	else if (scheduler_toplevel() < cur->t_priority) {
+		sched_preemptions++;
+		cur->t_nivcsw++;
+		thread_yield();
+	}
 }
 
 /*
- * Debugging function to dump the run queue.
+ * Set the base quantum to TICKS hardclock ticks.
+ */
+void
+scheduler_setquantum(int ticks)
+{
+	int spl, i;
+
+	assert(ticks >= 1 && ticks <= SCHED_MAXQUANTUM);
+
+	spl = splhigh();
+	sched_basequantum = ticks;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		sched_quantum[i] = ticks << i;
+	}
+	splx(spl);
+}
+
+/*
+ * setpriority() system call. Sets the base level of process PID; the
+ * thread runs at that level right away and is never boosted above it.
+ */
+int
+sys_setpriority(int pid, int level, int *retval)
+{
+	struct thread *t;
+	int spl;
+
+	if (level < 0 || level >= SCHED_NLEVELS) {
+		return EINVAL;
+	}
+	spl = splhigh();
+	t = pid_getthread(pid);
+	if (t == NULL) {
+		splx(spl);
+		return ESRCH;
+	}
+	/* if it is sitting in a queue, this takes effect when it is next queued */
+	t->t_basepriority = level;
+	t->t_priority = level;
+	t->t_ticks = 0;
+	splx(spl);
+
+	*retval = 0;
+	return 0;
+}
+
+/*
+ * settickets() system call. Sets the CPU share of process PID under the
+ * stride policy.
+ */
+int
+sys_settickets(int pid, int tickets, int *retval)
+{
+	struct thread *t;
+	int spl;
+
+	if (tickets < 1 || tickets > STRIDE_MAXTICKETS) {
+		return EINVAL;
+	}
+	spl = splhigh();
+	t = pid_getthread(pid);
+	if (t == NULL) {
+		splx(spl);
+		return ESRCH;
+	}
+	thread_settickets(t, tickets);
+	splx(spl);
+
+	*retval = 0;
+	return 0;
+}
+
+/*
+ * Set T's tickets. If T is in the heap its pass is unchanged, so the
+ * heap stays ordered; the new stride applies from its next tick.
+ */
+void
+thread_settickets(struct thread *t, int tickets)
+{
+	assert(tickets >= 1 && tickets <= STRIDE_MAXTICKETS);
+	t->t_tickets = tickets;
+	t->t_stride = STRIDE1 / tickets;
+}
+
+/*
+ * Switch between SCHED_MLFQ and SCHED_STRIDE, moving every runnable
+ * thread over to the new policy's run queue.
+ */
+void
+scheduler_setpolicy(int policy)
+{
+	struct thread *t;
+	int spl, i;
+
+	assert(policy == SCHED_MLFQ || policy == SCHED_STRIDE);
+
+	spl = splhigh();
+	if (policy == sched_policy) {
+		splx(spl);
+		return;
+	}
+
+	if (policy == SCHED_STRIDE) {
+		sched_policy = policy;
+		for (i=0; i<SCHED_NLEVELS; i++) {
+			while (!rq_empty(&runqueues[i])) {
+				t = rq_remhead(&runqueues[i]);
+				t->t_pass = stride_globalpass;
+				stride_push(t);
+			}
+		}
+	}
+	else {
+		sched_policy = policy;
+		while (!rq_empty(&stride_queue)) {
+			t = stride_pop();
+			t->t_ticks = 0;
+			rq_addtail(&runqueues[t->t_priority], t);
+		}
+	}
+	splx(spl);
+}
+
+int
+scheduler_getpolicy(void)
+{
+	return sched_policy;
+}
+
+/*
+ * Debugging function to dump the run queues.
  */
 void
 print_run_queue(void)
@@ -126,15 +762,142 @@ print_run_queue(void)
 	/* Turn interrupts off so the whole list prints atomically. */
 	int spl = splhigh();
 
-	int i,k=0;
-	i = q_getstart(runqueue);
-	
-	while (i!=q_getend(runqueue)) {
-		struct thread *t = q_getguy(runqueue, i);
-		kprintf("  %2d: %s %p\n", k, t->t_name, t->t_sleepaddr);
-		i=(i+1)%q_getsize(runqueue);
-		k++;
+	struct thread *t;
+	int k,level;
+
+	if (sched_policy == SCHED_STRIDE) {
+		kprintf("stride: %d thread(s), global pass %u\n",
+			stride_queue.rq_count, stride_globalpass);
+		/* heap order: only the first thread is sure to run next */
+		k = 0;
+		for (t = stride_queue.rq_head; t != NULL; t = stride_walk(t)) {
+			kprintf("  %2d: %s %p (tickets %d, pass %u, "
+				"preempted %lu)\n", k, t->t_name,
+				t->t_sleepaddr, t->t_tickets, t->t_pass,
+				t->t_nivcsw);
+			k++;
+		}
+		kprintf("quantum %d, expiries %lu, kept %lu\n",
+			sched_basequantum, sched_expiries, sched_kept);
+		splx(spl);
+		return;
+	}
+
+	for (level=0; level<SCHED_NLEVELS; level++) {
+		kprintf("level %d (quantum %d): %d thread(s)\n", level,
+			sched_quantum[level], runqueues[level].rq_count);
+		k = 0;
+		for (t = runqueues[level].rq_head; t != NULL; t = t->t_rqnext) {
+			kprintf("  %2d: %s %p (base %d, preempted %lu)\n", k,
+				t->t_name, t->t_sleepaddr, t->t_basepriority,
+				t->t_nivcsw);
+			k++;
+		}
 	}
+	kprintf("demotions %lu, promotions %lu, preemptions %lu, boosts %lu\n",
+		sched_demotions, sched_promotions, sched_preemptions,
+		sched_boosts);
+	kprintf("involuntary switches %lu (%lu preemptions, %lu expiries), "
+		"quanta kept %lu\n", sched_preemptions + sched_expiries,
+		sched_preemptions, sched_expiries, sched_kept);
 	
 	splx(spl);
 }
+
+/*
+ * Stride benchmark: run one CPU-bound thread per argument, each with
+ * that many tickets, for a few seconds, then show how the CPU was
+ * shared. Runs under the stride policy for the duration.
+ */
+
+#define SB_MAXTHREADS 8
+#define SB_SECONDS 5
+
+static volatile int sb_stop;
+static volatile unsigned long sb_loops[SB_MAXTHREADS];
+static volatile unsigned long sb_ticks[SB_MAXTHREADS];
+static volatile int sb_running;
+
+static
+void
+sb_worker(void *unused, unsigned long which)
+{
+	int spl;
+
+	(void)unused;
+
+	while (!sb_stop) {
+		sb_loops[which]++;
+	}
+
+	spl = splhigh();
+	sb_ticks[which] = curthread->t_cputicks;
+	sb_running--;
+	splx(spl);
+}
+
+int
+stridebench(int nargs, char **args)
+{
+	unsigned long totalticks;
+	int tickets[SB_MAXTHREADS];
+	int n, i, oldpolicy, result, spl;
+	struct thread *t;
+
+	n = nargs - 1;
+	if (n < 1 || n > SB_MAXTHREADS) {
+		kprintf("Usage: sb tickets1 [tickets2 ...] (up to %d)\n",
+			SB_MAXTHREADS);
+		return EINVAL;
+	}
+	for (i=0; i<n; i++) {
+		tickets[i] = atoi(args[i+1]);
+		if (tickets[i] < 1 || tickets[i] > STRIDE_MAXTICKETS) {
+			kprintf("sb: tickets must be 1..%d\n", STRIDE_MAXTICKETS);
+			return EINVAL;
+		}
+	}
+
+	oldpolicy = scheduler_getpolicy();
+	scheduler_setpolicy(SCHED_STRIDE);
+
+	sb_stop = 0;
+	sb_running = 0;
+	for (i=0; i<n; i++) {
+		sb_loops[i] = 0;
+		sb_ticks[i] = 0;
+
+		/* set tickets before the worker can run */
+		spl = splhigh();
+		result = thread_fork("stridebench", NULL, i, sb_worker, &t);
+		if (result) {
+			splx(spl);
+			kprintf("sb: thread_fork failed: %s\n", strerror(result));
+			sb_stop = 1;
+			break;
+		}
+		thread_settickets(t, tickets[i]);
+		sb_running++;
+		splx(spl);
+	}
+
+	clocksleep(SB_SECONDS);
+	sb_stop = 1;
+	while (sb_running > 0) {
+		thread_yield();
+	}
+
+	totalticks = 0;
+	for (i=0; i<n; i++) {
+		totalticks += sb_ticks[i];
+	}
+	for (i=0; i<n; i++) {
+		kprintf("  tickets %4d: %4lu ticks (%3lu%%), %lu loops\n",
+			tickets[i], sb_ticks[i],
+			totalticks ? sb_ticks[i] * 100 / totalticks : 0,
+			sb_loops[i]);
+	}
+
+	scheduler_setpolicy(oldpolicy);
+	return 0;
+}
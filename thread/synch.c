@@ -5,11 +5,27 @@
 
 #include <types.h>
 #include <lib.h>
+#include <kern/errno.h>
 #include <synch.h>
 #include <thread.h>
 #include <curthread.h>
 #include <machine/spl.h>
-#include <queue.h>
+#include <clock.h>
+#include <test.h>
+
+/*
+ * Waiters are woken one at a time, oldest first, and whatever they were
+ * waiting for is handed to them directly: V() gives its count to the
+ * thread it wakes, lock_release() makes that thread the owner, and
+ * cv_signal() moves the waiter onto the lock so it is woken already
+ * holding it. Nobody wakes up just to find the resource gone and go
+ * back to sleep.
+ */
+
+/* statistics */
+static unsigned long synch_handoffs;	/* sem/lock passed straight to a waiter */
+static unsigned long synch_requeues;	/* cv waiters moved onto the lock */
+static unsigned long synch_saved;	/* wakeups a broadcast would have wasted */
 
 ////////////////////////////////////////////////////////////
 //
@@ -75,23 +91,54 @@ P(struct semaphore *sem)
 	assert(in_interrupt==0);
 
 	spl = splhigh();
-	while (sem->count==0) {
+	if (sem->count==0) {
+		/* V() hands its count straight to us */
 		thread_sleep(sem);
 	}
-	assert(sem->count>0);
-	sem->count--;
+	else {
+		sem->count--;
+	}
 	splx(spl);
 }
 
+/*
+ * P with a timeout: gives up after TICKS clock ticks and returns
+ * EAGAIN. Returns 0 once it has the count.
+ */
+int
+P_timed(struct semaphore *sem, u_int32_t ticks)
+{
+	int spl, result;
+	assert(sem != NULL);
+	assert(in_interrupt==0);
+
+	spl = splhigh();
+	if (sem->count==0) {
+		/* if V() wakes us it has handed us its count */
+		result = thread_sleep_timeout(sem, ticks);
+	}
+	else {
+		sem->count--;
+		result = 0;
+	}
+	splx(spl);
+	return result;
+}
+
 void
 V(struct semaphore *sem)
 {
 	int spl;
 	assert(sem != NULL);
 	spl = splhigh();
-	sem->count++;
-	assert(sem->count>0);
-	thread_wakeup(sem);
+	if (thread_wakeup_one(sem) != NULL) {
+		synch_handoffs++;
+		synch_saved += thread_sleepercount(sem);
+	}
+	else {
+		sem->count++;
+		assert(sem->count>0);
+	}
 	splx(spl);
 }
 
@@ -115,9 +162,9 @@ lock_create(const char *name)
 		return NULL;
 	}
 	
-        //initialize the lock to no owner and make a wait queue
+        //initialize the lock to no owner; waiters sleep on the lock
         lock->isHeld = 0;
-        lock->waitqueue = q_create(256);
+        lock->owner = 0;
         
 	return lock;
 }
@@ -129,17 +176,13 @@ lock_destroy(struct lock *lock)
         assert(lock != NULL);
         
         spl = splhigh();
-        //while the lock is being held, add current thread to the waitqueue
-        //and put the thread to sleep
-        while(lock->isHeld == 1){
-            q_addtail(lock->waitqueue, (void *)curthread);
-            thread_sleep(curthread);   
-        }   
+        //if the lock is being held, wait in line until it is handed to us
+        if(lock->isHeld == 1 && lock->owner != (volatile int)curthread){
+            thread_sleep(lock);
+        }
+        assert(thread_hassleepers(lock) == 0);
         splx(spl);
         
-        //once thread is awake, destroy the waitqueue and free up the memory
-        q_destroy(lock->waitqueue);
-        
 	kfree(lock->name);
 	kfree(lock);
 }
@@ -150,17 +193,40 @@ lock_acquire(struct lock *lock)
     int spl;
     spl = splhigh();
     
-    //while the lock is being held, add current thread to the waitqueue
-    //and put the thread to sleep
-    while(lock->isHeld == 1){
-        q_addtail(lock->waitqueue, (void *)curthread);
-        thread_sleep(curthread);   
+    //while the lock is being held, sleep on it; lock_release hands it
+    //to the waiters in the order they arrived
+    if(lock->isHeld == 1){
+        thread_sleep(lock);
+        assert(lock->isHeld == 1 && lock->owner == (volatile int)curthread);
+    }
+    else{
+        lock->owner = (volatile int)curthread;
+        lock->isHeld = 1;
+    }
+    
+    splx(spl);
+}
+
+//like lock_acquire, but give up with EAGAIN after TICKS clock ticks
+int
+lock_acquire_timed(struct lock *lock, u_int32_t ticks)
+{
+    int spl, result;
+    spl = splhigh();
+    
+    if(lock->isHeld == 1){
+        //on a timeout we are out of line and the lock went to someone else
+        result = thread_sleep_timeout(lock, ticks);
+        assert(result != 0 || lock->owner == (volatile int)curthread);
+    }
+    else{
+        lock->owner = (volatile int)curthread;
+        lock->isHeld = 1;
+        result = 0;
     }
-    //once thread is awake, make the current thread the owner of the lock
-    lock->owner = (volatile int)curthread;
-    lock->isHeld = 1;
     
     splx(spl);
+    return result;
 }
 
 void
@@ -170,13 +236,17 @@ lock_release(struct lock *lock)
     spl = splhigh(); 
     
     //if the lock is currently being held, and the owner is the current thread
-    //unlock the lock and wakeup the next thread in the waitqueue
+    //pass it to the next waiter, or unlock it if there is none
     if(lock->isHeld == 1 && lock->owner == (volatile int)curthread){
-        lock->isHeld = 0; 
-        lock->owner = 0; 
+        struct thread *next = thread_wakeup_one(lock);
         
-        if(q_empty(lock->waitqueue) == 0){
-            thread_wakeup((void *)q_remhead(lock->waitqueue));
+        if(next != NULL){
+            lock->owner = (volatile int)next;
+            synch_handoffs++;
+        }
+        else{
+            lock->isHeld = 0; 
+            lock->owner = 0; 
         }
     }
     
@@ -223,9 +293,7 @@ cv_create(const char *name)
 		return NULL;
 	}
 	
-	// add stuff here as needed
-        
-        cv->waitqueue = q_create(256);	
+	// waiters sleep on the cv itself
 	return cv;
 }
 
@@ -234,8 +302,10 @@ cv_destroy(struct cv *cv)
 {
 	assert(cv != NULL);
 
-	// add stuff here as needed
-	q_destroy(cv->waitqueue);
+	int spl = splhigh();
+	assert(thread_hassleepers(cv) == 0);
+	splx(spl);
+
 	kfree(cv->name);
 	kfree(cv);
 }
@@ -243,42 +313,211 @@ cv_destroy(struct cv *cv)
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-    lock_release(lock);
-    
     int spl;
     spl = splhigh();
     
-    q_addtail(cv->waitqueue, (void *)curthread);
-    thread_sleep(curthread);
+    //release and sleep atomically, so a signal in between is not lost
+    lock_release(lock);
+    thread_sleep(cv);
+    
+    //cv_signal may have moved us onto the lock, which was then handed to us
+    if(lock->owner != (volatile int)curthread){
+        lock_acquire(lock);
+    }
     
     splx(spl);
+}
+
+/*
+ * cv_wait with a timeout. Returns EAGAIN if TICKS clock ticks pass
+ * without a signal; either way the lock is held again on return.
+ */
+int
+cv_wait_timed(struct cv *cv, struct lock *lock, u_int32_t ticks)
+{
+    int spl, result;
+    spl = splhigh();
+    
+    lock_release(lock);
+    //a signal that moves us onto the lock cancels the timeout
+    result = thread_sleep_timeout(cv, ticks);
+    
+    if(lock->owner != (volatile int)curthread){
+        lock_acquire(lock);
+    }
     
-    lock_acquire(lock);
-    (void)cv;
+    splx(spl);
+    return result;
 }
 
+/*
+ * Wake the longest waiter. If the caller holds the lock, as it should,
+ * the waiter could only run to block on the lock again, so it is moved
+ * to the lock's queue instead and wakes up holding it.
+ */
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
     int spl;
     spl = splhigh();
     
-    thread_wakeup((void *)q_remhead(cv->waitqueue));
+    //with no waiters this is a no-op
+    if(lock_do_i_hold(lock)){
+        synch_requeues += thread_requeue(cv, lock, 0);
+    }
+    else{
+        thread_wakeup_one(cv);
+    }
     
     splx(spl);
-    (void)lock;
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-    int spl;
+    int spl, n;
     spl = splhigh();
     
-    while(q_empty(cv->waitqueue) != 1){
-        thread_wakeup((void *)q_remhead(cv->waitqueue));
+    if(lock_do_i_hold(lock)){
+        n = thread_requeue(cv, lock, 1);
+        synch_requeues += n;
+        //all but the first would have woken only to sleep on the lock
+        if(n > 1){
+            synch_saved += n - 1;
+        }
+    }
+    else{
+        thread_wakeup(cv);
     }
     
     splx(spl);
-    (void)lock;
+}
+
+void
+synch_printstats(void)
+{
+    kprintf("synch: %lu hand-offs, %lu cv waiters moved to locks\n",
+	    synch_handoffs, synch_requeues);
+    kprintf("synch: %lu spurious wakeups avoided\n", synch_saved);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Ping-pong benchmark: two threads bounce a token back and forth
+// through a pair of semaphores while other threads keep the CPU busy,
+// with sleep hand-off off and then on.
+
+#define PP_ROUNDS 1000
+#define PP_MAXSPIN 8
+
+static struct semaphore *pp_ping, *pp_pong, *pp_done;
+static volatile int pp_stop;
+
+static
+void
+pp_ponger(void *unused, unsigned long rounds)
+{
+	unsigned long i;
+
+	(void)unused;
+
+	for (i=0; i<rounds; i++) {
+		P(pp_ping);
+		V(pp_pong);
+	}
+	V(pp_done);
+}
+
+static
+void
+pp_spinner(void *unused, unsigned long junk)
+{
+	(void)unused;
+	(void)junk;
+
+	while (!pp_stop) {
+		/* nothing */
+	}
+	V(pp_done);
+}
+
+static
+int
+pp_run(int nspin, int handoff)
+{
+	time_t beforesecs, aftersecs, secs;
+	u_int32_t beforensecs, afternsecs, nsecs;
+	int i, result, nthreads;
+
+	thread_sethandoff(handoff);
+	pp_stop = 0;
+	nthreads = 0;
+
+	for (i=0; i<nspin; i++) {
+		result = thread_fork("pp spinner", NULL, 0, pp_spinner, NULL);
+		if (result) {
+			goto done;
+		}
+		nthreads++;
+	}
+	result = thread_fork("pp ponger", NULL, PP_ROUNDS, pp_ponger, NULL);
+	if (result) {
+		goto done;
+	}
+	nthreads++;
+
+	gettime(&beforesecs, &beforensecs);
+	for (i=0; i<PP_ROUNDS; i++) {
+		V(pp_ping);
+		P(pp_pong);
+	}
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+
+	kprintf("  hand-off %-3s: %d round trips in %lu.%09lu seconds, "
+		"%lu us each\n", handoff ? "on" : "off", PP_ROUNDS,
+		(unsigned long) secs, (unsigned long) nsecs,
+		((unsigned long) secs * 1000000 + nsecs / 1000) / PP_ROUNDS);
+
+ done:
+	pp_stop = 1;
+	while (nthreads-- > 0) {
+		P(pp_done);
+	}
+	if (result) {
+		kprintf("pp: thread_fork failed: %s\n", strerror(result));
+	}
+	return result;
+}
+
+int
+pingpongbench(int nargs, char **args)
+{
+	int nspin, result;
+
+	nspin = nargs > 1 ? atoi(args[1]) : 4;
+	if (nspin < 0 || nspin > PP_MAXSPIN) {
+		kprintf("Usage: pp [spinners (0-%d)]\n", PP_MAXSPIN);
+		return EINVAL;
+	}
+
+	pp_ping = sem_create("pp ping", 0);
+	pp_pong = sem_create("pp pong", 0);
+	pp_done = sem_create("pp done", 0);
+	if (pp_ping == NULL || pp_pong == NULL || pp_done == NULL) {
+		panic("pingpongbench: sem_create failed\n");
+	}
+
+	kprintf("ping-pong with %d busy thread(s):\n", nspin);
+	result = pp_run(nspin, 0);
+	if (result == 0) {
+		result = pp_run(nspin, 1);
+	}
+	thread_sethandoff(1);
+
+	sem_destroy(pp_done);
+	sem_destroy(pp_pong);
+	sem_destroy(pp_ping);
+	return result;
 }
@@ -10,6 +10,10 @@
 #include <thread.h>
 #include <curthread.h>
 #include <scheduler.h>
+#include <clock.h>
+#include <syscall.h>
+#include <test.h>
+#include <pid.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <vfs.h>
@@ -26,12 +30,41 @@ typedef enum {
 /* Global variable for the thread currently executing at any given time. */
 struct thread *curthread;
 
-/* Table of sleeping threads. */
-static struct array *sleepers;
+/*
+ * Sleeping threads, by sleep address. Each address that has sleepers
+ * has a wait channel holding them in the order they went to sleep, and
+ * the wait channels are chained in a hash table on the address. Wait
+ * channels come from a free list that thread_fork keeps at least as
+ * long as the number of threads, so going to sleep never allocates.
+ */
+struct wchan {
+	const void *wc_addr;
+	struct thread *wc_head;		/* sleepers, linked by t_sleepnext */
+	struct thread *wc_tail;
+	int wc_count;
+	struct wchan *wc_next;		/* hash chain or free list */
+};
+
+#define SLEEP_NBUCKETS 128
+
+static struct wchan **sleephash;
+static struct wchan *wchan_freelist;
+static int wchan_total;
 
 /* List of dead threads to be disposed of. */
 static struct array *zombies;
 
+/*
+ * If set, a thread that goes to sleep right after waking another with
+ * thread_wakeup_one (V, lock_release, ...) switches straight to that
+ * thread instead of whatever is at the head of the run queue.
+ */
+static int sleep_handoff = 1;
+
+/* statistics */
+static unsigned long yieldto_count;	/* thread_yield_to switches */
+static unsigned long handoff_count;	/* sleeps that handed off */
+
 /* Total number of outstanding threads. Does not count zombies[]. */
 static int numthreads;
 
@@ -45,6 +78,8 @@ thread_count(void)
 	return numthreads;
 }
 
+static void thread_timeout(void *data);
+
 /*
  * Create a thread. This is used both to create the first thread's 
  * thread structure and to create subsequent threads.
@@ -64,6 +99,15 @@ thread_create(const char *name)
 		return NULL;
 	}
 	thread->t_sleepaddr = NULL;
+	thread->t_sleepnext = NULL;
+	thread->t_wakee = NULL;
+	timer_init(&thread->t_timer, thread_timeout, thread);
+	thread->t_timedout = 0;
+	thread->t_joinable = 0;
+	thread->t_joined = 0;
+	thread->t_exited = 0;
+	thread->t_reapable = 0;
+	thread->t_exitcode = 0;
 	thread->t_stack = NULL;
 	
     thread->pid = -10;
@@ -84,6 +128,18 @@ thread_create(const char *name)
 	thread->textmemsize = 0;
 	thread->textfilesize = 0;
 	thread->textflags = 0;
+
+	thread->t_priority = 0;
+	thread->t_basepriority = 0;
+	thread->t_ticks = 0;
+	thread->t_cputicks = 0;
+	thread->t_nivcsw = 0;
+	thread->t_rqnext = NULL;
+	thread->t_rqprev = NULL;
+	thread->t_rqchild = NULL;
+	thread->t_runqueue = NULL;
+	thread->t_pass = 0;
+	thread_settickets(thread, STRIDE_DEFTICKETS);
         
 	return thread;
 }
@@ -131,13 +187,198 @@ exorcise(void)
 	for (i=0; i<array_getnum(zombies); i++) {
 		struct thread *z = array_getguy(zombies, i);
 		assert(z!=curthread);
-		thread_destroy(z);
+		if (z->t_joinable) {
+			/* off the cpu now; thread_join frees it */
+			z->t_reapable = 1;
+		}
+		else {
+			thread_destroy(z);
+		}
 	}
 	result = array_setsize(zombies, 0);
 	/* Shrinking the array; not supposed to be able to fail. */
 	assert(result==0);
 }
 
+static
+unsigned
+sleep_hash(const void *addr)
+{
+	u_int32_t a = (u_int32_t)addr;
+
+	/* sleep addresses are mostly word-aligned kernel pointers */
+	a = (a >> 2) ^ (a >> 9);
+	return a % SLEEP_NBUCKETS;
+}
+
+/*
+ * Make sure there are at least N wait channels, allocated or free.
+ */
+static
+int
+wchan_preallocate(int n)
+{
+	struct wchan *wc;
+
+	while (wchan_total < n) {
+		wc = kmalloc(sizeof(struct wchan));
+		if (wc == NULL) {
+			return ENOMEM;
+		}
+		wc->wc_next = wchan_freelist;
+		wchan_freelist = wc;
+		wchan_total++;
+	}
+	return 0;
+}
+
+/*
+ * Find the wait channel for ADDR. If there is none and CREATE is set,
+ * take one from the free list. Sets *PREVP to the link pointing at it.
+ */
+static
+struct wchan *
+wchan_lookup(const void *addr, int create, struct wchan ***prevp)
+{
+	struct wchan **prev;
+	struct wchan *wc;
+
+	prev = &sleephash[sleep_hash(addr)];
+	for (wc = *prev; wc != NULL; wc = wc->wc_next) {
+		if (wc->wc_addr == addr) {
+			*prevp = prev;
+			return wc;
+		}
+		prev = &wc->wc_next;
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	/* thread_fork keeps one per thread, so this cannot run out */
+	wc = wchan_freelist;
+	assert(wc != NULL);
+	wchan_freelist = wc->wc_next;
+
+	wc->wc_addr = addr;
+	wc->wc_head = wc->wc_tail = NULL;
+	wc->wc_count = 0;
+	wc->wc_next = NULL;
+	*prev = wc;
+	*prevp = prev;
+	return wc;
+}
+
+/*
+ * Unhash wait channel WC, which PREV points at, and free it.
+ */
+static
+void
+wchan_release(struct wchan **prev, struct wchan *wc)
+{
+	*prev = wc->wc_next;
+	wc->wc_next = wchan_freelist;
+	wchan_freelist = wc;
+}
+
+/*
+ * Put T, which is going to sleep on t_sleepaddr, on its wait channel.
+ */
+static
+void
+wchan_add(struct thread *t)
+{
+	struct wchan **prev;
+	struct wchan *wc;
+
+	wc = wchan_lookup(t->t_sleepaddr, 1, &prev);
+	t->t_sleepnext = NULL;
+	if (wc->wc_tail == NULL) {
+		wc->wc_head = t;
+	}
+	else {
+		wc->wc_tail->t_sleepnext = t;
+	}
+	wc->wc_tail = t;
+	wc->wc_count++;
+}
+
+/*
+ * Take the first sleeper off wait channel WC, which PREV points at,
+ * freeing the channel if that was the last one.
+ */
+static
+struct thread *
+wchan_remhead(struct wchan **prev, struct wchan *wc)
+{
+	struct thread *t = wc->wc_head;
+
+	assert(t != NULL);
+	wc->wc_head = t->t_sleepnext;
+	t->t_sleepnext = NULL;
+	wc->wc_count--;
+	if (wc->wc_head == NULL) {
+		wc->wc_tail = NULL;
+		wchan_release(prev, wc);
+	}
+	return t;
+}
+
+/*
+ * Take sleeping thread T off its wait channel, wherever it is in line.
+ */
+static
+void
+wchan_remove(struct thread *t)
+{
+	struct wchan **prev;
+	struct wchan *wc;
+	struct thread *p;
+
+	wc = wchan_lookup(t->t_sleepaddr, 0, &prev);
+	assert(wc != NULL);
+
+	if (wc->wc_head == t) {
+		wchan_remhead(prev, wc);
+		return;
+	}
+	for (p = wc->wc_head; p->t_sleepnext != t; p = p->t_sleepnext) {
+		assert(p->t_sleepnext != NULL);
+	}
+	p->t_sleepnext = t->t_sleepnext;
+	if (wc->wc_tail == t) {
+		wc->wc_tail = p;
+	}
+	t->t_sleepnext = NULL;
+	wc->wc_count--;
+}
+
+/*
+ * Make sleeping thread T runnable.
+ */
+static
+void
+thread_makeawake(struct thread *t)
+{
+	int result;
+
+	/*
+	 * It is off its wait channel now; a timeout from
+	 * thread_sleep_timeout no longer applies.
+	 */
+	timer_del(&t->t_timer);
+	t->t_sleepaddr = NULL;
+
+	scheduler_wakeup(t);
+
+	/*
+	 * Because we preallocate during thread_fork,
+	 * this should never fail.
+	 */
+	result = make_runnable(t);
+	assert(result==0);
+}
+
 /*
  * Kill all sleeping threads. This is used during panic shutdown to make 
  * sure they don't wake up again and interfere with the panic.
@@ -146,7 +387,9 @@ static
 void
 thread_killall(void)
 {
-	int i, result;
+	struct wchan *wc;
+	struct thread *t;
+	int i;
 
 	assert(curspl>0);
 
@@ -155,23 +398,23 @@ thread_killall(void)
 	 * wake up while we're shutting down.
 	 */
 
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
-		kprintf("sleep: Dropping thread %s\n", t->t_name);
-
-		/*
-		 * Don't do this: because these threads haven't
-		 * been through thread_exit, thread_destroy will
-		 * get upset. Just drop the threads on the floor,
-		 * which is safer anyway during panic.
-		 *
-		 * array_add(zombies, t);
-		 */
+	for (i=0; i<SLEEP_NBUCKETS; i++) {
+		while ((wc = sleephash[i]) != NULL) {
+			for (t = wc->wc_head; t != NULL; t = t->t_sleepnext) {
+				kprintf("sleep: Dropping thread %s\n", t->t_name);
+
+				/*
+				 * Don't do this: because these threads haven't
+				 * been through thread_exit, thread_destroy will
+				 * get upset. Just drop the threads on the floor,
+				 * which is safer anyway during panic.
+				 *
+				 * array_add(zombies, t);
+				 */
+			}
+			wchan_release(&sleephash[i], wc);
+		}
 	}
-
-	result = array_setsize(sleepers, 0);
-	/* shrinking array: not supposed to fail */
-	assert(result==0);
 }
 
 /*
@@ -194,10 +437,18 @@ thread_bootstrap(void)
 {
 	struct thread *me;
 
+	int i;
+
 	/* Create the data structures we need. */
-	sleepers = array_create();
-	if (sleepers==NULL) {
-		panic("Cannot create sleepers array\n");
+	sleephash = kmalloc(SLEEP_NBUCKETS * sizeof(struct wchan *));
+	if (sleephash==NULL) {
+		panic("Cannot create sleep hash table\n");
+	}
+	for (i=0; i<SLEEP_NBUCKETS; i++) {
+		sleephash[i] = NULL;
+	}
+	if (wchan_preallocate(1)) {
+		panic("Cannot create wait channels\n");
 	}
 
 	zombies = array_create();
@@ -238,8 +489,15 @@ thread_bootstrap(void)
 void
 thread_shutdown(void)
 {
-	array_destroy(sleepers);
-	sleepers = NULL;
+	struct wchan *wc;
+
+	while ((wc = wchan_freelist) != NULL) {
+		wchan_freelist = wc->wc_next;
+		kfree(wc);
+	}
+	wchan_total = 0;
+	kfree(sleephash);
+	sleephash = NULL;
 	array_destroy(zombies);
 	zombies = NULL;
 	// Don't do this - it frees our stack and we blow up
@@ -248,13 +506,15 @@ thread_shutdown(void)
 /*
  * Create a new thread based on an existing one.
  * The new thread has name NAME, and starts executing in function FUNC.
- * DATA1 and DATA2 are passed to FUNC.
+ * DATA1 and DATA2 are passed to FUNC. If JOINABLE is set the thread
+ * structure outlives the thread until thread_join collects it.
  */
+static
 int
-thread_fork(const char *name, 
-	    void *data1, unsigned long data2,
-	    void (*func)(void *, unsigned long),
-	    struct thread **ret)
+thread_fork_common(const char *name, 
+		   void *data1, unsigned long data2,
+		   void (*func)(void *, unsigned long),
+		   struct thread **ret, int joinable)
 {
 	struct thread *newguy;
 	int s, result;
@@ -279,6 +539,13 @@ thread_fork(const char *name,
 	newguy->t_stack[2] = 0xda;
 	newguy->t_stack[3] = 0x33;
 
+	/* Inherit the scheduling priority */
+	if (curthread != NULL) {
+		newguy->t_basepriority = curthread->t_basepriority;
+		newguy->t_priority = newguy->t_basepriority;
+		thread_settickets(newguy, curthread->t_tickets);
+	}
+
 	/* Inherit the current directory */
 	if (curthread->t_cwd != NULL) {
 		VOP_INCREF(curthread->t_cwd);
@@ -295,7 +562,7 @@ thread_fork(const char *name,
 	 * Make sure our data structures have enough space, so we won't
 	 * run out later at an inconvenient time.
 	 */
-	result = array_preallocate(sleepers, numthreads+1);
+	result = wchan_preallocate(numthreads+1);
 	if (result) {
 		goto fail;
 	}
@@ -310,6 +577,8 @@ thread_fork(const char *name,
 		goto fail;
 	}
 
+	newguy->t_joinable = joinable;
+
 	/* Make the new thread runnable */
 	result = make_runnable(newguy);
 	if (result != 0) {
@@ -351,24 +620,81 @@ thread_fork(const char *name,
 	return result;
 }
 
+int
+thread_fork(const char *name, 
+	    void *data1, unsigned long data2,
+	    void (*func)(void *, unsigned long),
+	    struct thread **ret)
+{
+	return thread_fork_common(name, data1, data2, func, ret, 0);
+}
+
 /*
- * Suspend execution of curthread until thread terminates. 
- * Return zero on success, EDEADLK if deadlock would occur.
+ * Like thread_fork, but the new thread must be waited for with
+ * thread_join, exactly once.
  */
-int thread_join(struct thread * thread)
+int
+thread_fork_joinable(const char *name, 
+		     void *data1, unsigned long data2,
+		     void (*func)(void *, unsigned long),
+		     struct thread **ret)
 {
-    while(thread->active == 0){
-        thread_yield();
-    }    
-    return 0;
+	assert(ret != NULL);
+	return thread_fork_common(name, data1, data2, func, ret, 1);
+}
+
+/*
+ * Suspend execution of curthread until thread terminates, sleeping on
+ * its exit, then free it. The exit code goes in *EXITCODE if it is not
+ * NULL. The thread must have been made with thread_fork_joinable.
+ * Return zero on success, EDEADLK if deadlock would occur, EINVAL if
+ * the thread cannot be joined.
+ */
+int
+thread_join(struct thread *thread, int *exitcode)
+{
+	int spl;
+
+	if (thread == curthread) {
+		return EDEADLK;
+	}
+
+	spl = splhigh();
+	if (!thread->t_joinable || thread->t_joined) {
+		splx(spl);
+		return EINVAL;
+	}
+	thread->t_joined = 1;
+
+	while (!thread->t_exited) {
+		thread_sleep(&thread->t_exited);
+	}
+	if (exitcode != NULL) {
+		*exitcode = thread->t_exitcode;
+	}
+
+	/*
+	 * If it has been switched out for good, it is ours to free;
+	 * otherwise exorcise will do it when it gets there.
+	 */
+	if (thread->t_reapable) {
+		thread_destroy(thread);
+	}
+	else {
+		thread->t_joinable = 0;
+	}
+	splx(spl);
+	return 0;
 }
 
 /*
- * High level, machine-independent context switch code.
+ * High level, machine-independent context switch code. Switches to
+ * TARGET if it is not NULL and is runnable, otherwise to whatever the
+ * scheduler picks.
  */
 static
 void
-mi_switch(threadstate_t nextstate)
+mi_switch(threadstate_t nextstate, struct thread *target)
 {
 	struct thread *cur, *next;
 	int result;
@@ -401,6 +727,9 @@ mi_switch(threadstate_t nextstate)
 	cur = curthread;
 	curthread = NULL;
 
+	/* whoever cur woke gets to run now or not at all by hand-off */
+	cur->t_wakee = NULL;
+
 	/*
 	 * Stash the current thread on whatever list it's supposed to go on.
 	 * Because we preallocate during thread_fork, this should not fail.
@@ -411,10 +740,11 @@ mi_switch(threadstate_t nextstate)
 	}
 	else if (nextstate==S_SLEEP) {
 		/*
-		 * Because we preallocate sleepers[] during thread_fork,
-		 * this should never fail.
+		 * Because we preallocate wait channels during
+		 * thread_fork, this cannot fail.
 		 */
-		result = array_add(sleepers, cur);
+		wchan_add(cur);
+		result = 0;
 	}
 	else {
 		assert(nextstate==S_ZOMB);
@@ -426,7 +756,12 @@ mi_switch(threadstate_t nextstate)
 	 * Call the scheduler (must come *after* the array_adds)
 	 */
 
-	next = scheduler();
+	if (target != NULL && scheduler_remove(target) == 0) {
+		next = target;
+	}
+	else {
+		next = scheduler();
+	}
 
 	/* update curthread */
 	curthread = next;
@@ -493,13 +828,70 @@ thread_exit(void)
 		curthread->t_cwd = NULL;
 	}
 
+	/* a process leaves its exit code in its pid record */
+	if (curthread->pid >= 0) {
+		pid_exit(curthread->pid, curthread->t_exitcode);
+		curthread->pid = -10;
+	}
+
+	/* hand the exit code to whoever is joining us */
+	curthread->t_exited = 1;
+	thread_wakeup(&curthread->t_exited);
+
 	assert(numthreads>0);
 	numthreads--;
-	mi_switch(S_ZOMB);
+	mi_switch(S_ZOMB, NULL);
 
 	panic("Thread came back from the dead!\n");
 }
 
+/*
+ * _exit() system call.
+ */
+void
+sys__exit(int code)
+{
+	thread_exitcode(code);
+}
+
+/*
+ * waitpid() system call. Sleeps until child PID exits, stores its exit
+ * code in *STATUS and frees the pid.
+ */
+int
+sys_waitpid(int pid, userptr_t status, int options, int *retval)
+{
+	int code, result;
+
+	if (options != 0) {
+		return EINVAL;
+	}
+
+	result = pid_wait(pid, curthread->pid, &code);
+	if (result) {
+		return result;
+	}
+
+	if (status != NULL) {
+		result = copyout(&code, status, sizeof(int));
+		if (result) {
+			return result;
+		}
+	}
+	*retval = pid;
+	return 0;
+}
+
+/*
+ * Exit with exit code CODE, for thread_join.
+ */
+void
+thread_exitcode(int code)
+{
+	curthread->t_exitcode = code;
+	thread_exit();
+}
+
 /*
  * Yield the cpu to another process, but stay runnable.
  */
@@ -509,12 +901,52 @@ thread_yield(void)
 	int spl = splhigh();
 
 	/* Check sleepers just in case we get here after shutdown */
-	assert(sleepers != NULL);
+	assert(sleephash != NULL);
 
-	mi_switch(S_READY);
+	mi_switch(S_READY, NULL);
 	splx(spl);
 }
 
+/*
+ * Yield the cpu directly to thread T, which must be runnable. The
+ * current thread stays runnable. Returns EINVAL if T is not waiting
+ * to run (it is running, asleep or gone).
+ */
+int
+thread_yield_to(struct thread *t)
+{
+	int spl = splhigh();
+
+	assert(sleephash != NULL);
+
+	if (t == curthread || !scheduler_isqueued(t)) {
+		splx(spl);
+		return EINVAL;
+	}
+	yieldto_count++;
+	mi_switch(S_READY, t);
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Turn sleep hand-off on or off.
+ */
+void
+thread_sethandoff(int on)
+{
+	sleep_handoff = on;
+}
+
+void
+thread_printstats(void)
+{
+	kprintf("threads: %d, sleep hand-off %s\n", numthreads,
+		sleep_handoff ? "on" : "off");
+	kprintf("  directed yields %lu, hand-offs on sleep %lu\n",
+		yieldto_count, handoff_count);
+}
+
 /*
  * Yield the cpu to another process, and go to sleep, on "sleep
  * address" ADDR. Subsequent calls to thread_wakeup with the same
@@ -529,14 +961,80 @@ thread_yield(void)
 void
 thread_sleep(const void *addr)
 {
+	struct thread *target = NULL;
+
 	// may not sleep in an interrupt handler
 	assert(in_interrupt==0);
 	
+	/*
+	 * If we just woke someone (V before P, say), they are what we are
+	 * waiting on: let them run now rather than after the whole run
+	 * queue. mi_switch clears t_wakee, so it cannot be stale here.
+	 */
+	if (sleep_handoff && curthread->t_wakee != NULL) {
+		target = curthread->t_wakee;
+		handoff_count++;
+	}
+
 	curthread->t_sleepaddr = addr;
-	mi_switch(S_SLEEP);
+	mi_switch(S_SLEEP, target);
 	curthread->t_sleepaddr = NULL;
 }
 
+/*
+ * Timer callback for thread_sleep_timeout: the sleep ran out, so take
+ * the thread off whatever it was waiting on and wake it.
+ */
+static
+void
+thread_timeout(void *data)
+{
+	struct thread *t = data;
+
+	/* already woken (the wake path disarms us, but be safe) */
+	if (t->t_sleepaddr == NULL) {
+		return;
+	}
+	wchan_remove(t);
+	t->t_timedout = 1;
+	thread_makeawake(t);
+}
+
+/*
+ * Like thread_sleep, but give up after TICKS clock ticks. Returns 0 if
+ * woken, EAGAIN if the time ran out. Interrupts must be off.
+ */
+int
+thread_sleep_timeout(const void *addr, u_int32_t ticks)
+{
+	assert(curspl>0);
+
+	curthread->t_timedout = 0;
+	timer_add(&curthread->t_timer, ticks);
+	thread_sleep(addr);
+	if (curthread->t_timedout) {
+		return EAGAIN;
+	}
+	timer_del(&curthread->t_timer);
+	return 0;
+}
+
+/*
+ * Sleep until tick DEADLINE (see timer_now).
+ */
+void
+thread_sleep_until(u_int32_t deadline)
+{
+	int spl = splhigh();
+	int32_t left = deadline - timer_now();
+
+	if (left > 0) {
+		/* nobody wakes us here; it always times out */
+		thread_sleep_timeout(curthread, left);
+	}
+	splx(spl);
+}
+
 /*
  * Wake up one or more threads who are sleeping on "sleep address"
  * ADDR.
@@ -544,31 +1042,92 @@ thread_sleep(const void *addr)
 void
 thread_wakeup(const void *addr)
 {
-	int i, result;
+	struct wchan **prev;
+	struct wchan *wc;
 	
 	// meant to be called with interrupts off
 	assert(curspl>0);
 	
-	// This is inefficient. Feel free to improve it.
-	
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
-		if (t->t_sleepaddr == addr) {
-			
-			// Remove from list
-			array_remove(sleepers, i);
-			
-			// must look at the same sleepers[i] again
-			i--;
-
-			/*
-			 * Because we preallocate during thread_fork,
-			 * this should never fail.
-			 */
-			result = make_runnable(t);
-			assert(result==0);
+	while ((wc = wchan_lookup(addr, 0, &prev)) != NULL) {
+		thread_makeawake(wchan_remhead(prev, wc));
+	}
+}
+
+/*
+ * Wake up the thread that has been sleeping longest on ADDR, if any.
+ * Returns the thread woken, or NULL. The caller may hand it something
+ * (a lock, a semaphore count) before it gets to run.
+ */
+struct thread *
+thread_wakeup_one(const void *addr)
+{
+	struct wchan **prev;
+	struct wchan *wc;
+	struct thread *t;
+
+	// meant to be called with interrupts off
+	assert(curspl>0);
+
+	wc = wchan_lookup(addr, 0, &prev);
+	if (wc == NULL) {
+		return NULL;
+	}
+	t = wchan_remhead(prev, wc);
+	thread_makeawake(t);
+
+	/* a candidate for hand-off if we go to sleep next */
+	if (curthread != NULL && !in_interrupt) {
+		curthread->t_wakee = t;
+	}
+	return t;
+}
+
+/*
+ * Move threads sleeping on FROM to the back of the sleepers on TO,
+ * without waking them: the oldest one, or all of them if ALL is set.
+ * They return from thread_sleep when TO is woken. Returns the number
+ * of threads moved.
+ */
+int
+thread_requeue(const void *from, const void *to, int all)
+{
+	struct wchan **prev;
+	struct wchan *wc;
+	struct thread *t;
+	int n = 0;
+
+	// meant to be called with interrupts off
+	assert(curspl>0);
+	assert(from != to);
+
+	while ((wc = wchan_lookup(from, 0, &prev)) != NULL) {
+		t = wchan_remhead(prev, wc);
+		t->t_sleepaddr = to;
+		wchan_add(t);
+		/* what it was waiting for came; it has no deadline for TO */
+		timer_del(&t->t_timer);
+		n++;
+		if (!all) {
+			break;
 		}
 	}
+	return n;
+}
+
+/*
+ * Number of threads sleeping on ADDR.
+ */
+int
+thread_sleepercount(const void *addr)
+{
+	struct wchan **prev;
+	struct wchan *wc;
+
+	// meant to be called with interrupts off
+	assert(curspl>0);
+
+	wc = wchan_lookup(addr, 0, &prev);
+	return wc == NULL ? 0 : wc->wc_count;
 }
 
 /*
@@ -578,18 +1137,12 @@ thread_wakeup(const void *addr)
 int
 thread_hassleepers(const void *addr)
 {
-	int i;
-	
+	struct wchan **prev;
+
 	// meant to be called with interrupts off
 	assert(curspl>0);
 	
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
-		if (t->t_sleepaddr == addr) {
-			return 1;
-		}
-	}
-	return 0;
+	return wchan_lookup(addr, 0, &prev) != NULL;
 }
 
 /*
@@ -627,3 +1180,62 @@ mi_threadstart(void *data1, unsigned long data2,
 	thread_exit();
 }
 
+
+/*
+ * Join benchmark: a joinable thread computes for a couple of seconds
+ * while we wait for it in thread_join. Shows how much CPU the waiter
+ * used meanwhile, which should be none.
+ */
+
+#define JB_TICKS (2*HZ)
+
+static
+void
+jb_worker(void *unused, unsigned long ticks)
+{
+	u_int32_t end = timer_now() + ticks;
+
+	(void)unused;
+
+	while ((int32_t)(end - timer_now()) > 0) {
+		/* spin */
+	}
+	thread_exitcode(42);
+}
+
+int
+joinbench(int nargs, char **args)
+{
+	struct thread *t;
+	unsigned long waitticks;
+	int result, code, spl;
+
+	(void)nargs;
+	(void)args;
+
+	result = thread_fork_joinable("joinbench", NULL, JB_TICKS,
+				      jb_worker, &t);
+	if (result) {
+		kprintf("jb: thread_fork failed: %s\n", strerror(result));
+		return result;
+	}
+
+	/* t stays valid until we join it */
+	spl = splhigh();
+	waitticks = curthread->t_cputicks;
+	splx(spl);
+
+	result = thread_join(t, &code);
+
+	spl = splhigh();
+	waitticks = curthread->t_cputicks - waitticks;
+	splx(spl);
+
+	if (result) {
+		kprintf("jb: thread_join failed: %s\n", strerror(result));
+		return result;
+	}
+	kprintf("jb: worker ran %d ticks and exited with %d; "
+		"the joiner used %lu ticks\n", JB_TICKS, code, waitticks);
+	return 0;
+}
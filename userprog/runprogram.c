@@ -74,6 +74,9 @@ runprogram(char *progname, char **args)
         return result;
     }
 
+    /* Load what this binary faulted on last time, or start recording. */
+    exectrace_exec(v);
+
     /* Done with the file now. */
     vfs_close(v);
 
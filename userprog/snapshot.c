@@ -0,0 +1,297 @@
+/*
+ * Process snapshots.
+ *
+ * A process that has finished its (expensive) initialisation calls
+ * snapshot(name). The kernel keeps a copy-on-write copy of its address
+ * space, the trapframe it made the call with, and what demand loading
+ * needs to know about its executable. New processes can then be started
+ * from the snapshot: each gets its own copy-on-write copy of the saved
+ * address space and resumes in user mode right after the snapshot()
+ * call, with a return value of 1 instead of 0. No runprogram, no
+ * load_elf, no startup faults.
+ *
+ * Pages are shared, not copied. Restored processes map them lazily
+ * through the normal fault path: resident pages are shared until
+ * written, and pages the pageout thread has moved to swap come back
+ * from the swap device on first touch. The snapshot's own page table
+ * keeps every page alive for as long as the snapshot exists.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/limits.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <curthread.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/trapframe.h>
+#include <syscall.h>
+#include <test.h>
+#include <pid.h>
+
+struct procsnap {
+	char *ps_name;
+	char *ps_progname;		/* executable, for demand loading */
+	struct addrspace *ps_as;	/* copy-on-write copy of the image */
+	struct trapframe ps_tf;		/* registers at the snapshot() call */
+
+	/* executable segment layout, from load_elf */
+	int ps_instoffset, ps_instmemsize, ps_instfilesize, ps_instflags;
+	int ps_textoffset, ps_textmemsize, ps_textfilesize, ps_textflags;
+
+	struct procsnap *ps_next;
+};
+
+/*
+ * Everything a restored thread needs, handed over from snapshot_spawn.
+ */
+struct snapstart {
+	struct addrspace *ss_as;
+	struct trapframe ss_tf;
+	int ss_parent;
+	struct procsnap ss_layout;	/* only the segment fields are used */
+};
+
+static struct procsnap *snapshots;
+static struct lock *snap_lock;
+
+/* statistics */
+static unsigned long snap_taken;
+static unsigned long snap_restored;
+
+void
+snapshot_bootstrap(void)
+{
+	snap_lock = lock_create("snapshots");
+	if (snap_lock == NULL) {
+		panic("snapshot_bootstrap: out of memory\n");
+	}
+}
+
+/* Called with snap_lock held. */
+static
+struct procsnap *
+snapshot_find(const char *name)
+{
+	struct procsnap *ps;
+
+	for (ps = snapshots; ps != NULL; ps = ps->ps_next) {
+		if (!strcmp(ps->ps_name, name)) {
+			return ps;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * snapshot() system call. Saves the calling process as NAME. Returns 0
+ * to the caller; processes started from the snapshot see 1.
+ */
+int
+sys_snapshot(userptr_t uname, struct trapframe *tf, int *retval)
+{
+	char name[NAME_MAX+1];
+	struct procsnap *ps;
+	int result;
+
+	result = copyinstr(uname, name, sizeof(name), NULL);
+	if (result) {
+		return result;
+	}
+
+	ps = kmalloc(sizeof(struct procsnap));
+	if (ps == NULL) {
+		return ENOMEM;
+	}
+	ps->ps_name = kstrdup(name);
+	ps->ps_progname = kstrdup(curthread->t_name);
+	if (ps->ps_name == NULL || ps->ps_progname == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+
+	result = as_copy(curthread->t_vmspace, &ps->ps_as);
+	if (result) {
+		goto fail;
+	}
+
+	ps->ps_tf = *tf;
+	ps->ps_instoffset = curthread->instoffset;
+	ps->ps_instmemsize = curthread->instmemsize;
+	ps->ps_instfilesize = curthread->instfilesize;
+	ps->ps_instflags = curthread->instflags;
+	ps->ps_textoffset = curthread->textoffset;
+	ps->ps_textmemsize = curthread->textmemsize;
+	ps->ps_textfilesize = curthread->textfilesize;
+	ps->ps_textflags = curthread->textflags;
+
+	lock_acquire(snap_lock);
+	if (snapshot_find(name) != NULL) {
+		lock_release(snap_lock);
+		as_destroy(ps->ps_as);
+		result = EEXIST;
+		goto fail;
+	}
+	ps->ps_next = snapshots;
+	snapshots = ps;
+	snap_taken++;
+	lock_release(snap_lock);
+
+	*retval = 0;
+	return 0;
+
+ fail:
+	if (ps->ps_progname != NULL) {
+		kfree(ps->ps_progname);
+	}
+	if (ps->ps_name != NULL) {
+		kfree(ps->ps_name);
+	}
+	kfree(ps);
+	return result;
+}
+
+/*
+ * First code run by a restored process. Takes a pid, installs the
+ * address space and drops to user mode at the snapshot() return.
+ */
+static
+void
+snapshot_thread(void *data, unsigned long unused)
+{
+	struct snapstart *ss = data;
+	struct trapframe tf;
+	int result;
+
+	(void)unused;
+
+	curthread->t_vmspace = ss->ss_as;
+	curthread->instoffset = ss->ss_layout.ps_instoffset;
+	curthread->instmemsize = ss->ss_layout.ps_instmemsize;
+	curthread->instfilesize = ss->ss_layout.ps_instfilesize;
+	curthread->instflags = ss->ss_layout.ps_instflags;
+	curthread->textoffset = ss->ss_layout.ps_textoffset;
+	curthread->textmemsize = ss->ss_layout.ps_textmemsize;
+	curthread->textfilesize = ss->ss_layout.ps_textfilesize;
+	curthread->textflags = ss->ss_layout.ps_textflags;
+
+	result = pid_alloc(curthread, ss->ss_parent);
+	if (result) {
+		kprintf("snapshot: cannot get a process id: %s\n",
+			strerror(result));
+		kfree(ss);
+		thread_exit();
+	}
+	curthread->active = 1;
+
+	/* The trapframe has to be on our own stack for mips_usermode. */
+	tf = ss->ss_tf;
+	kfree(ss);
+
+	tf.tf_v0 = 1;
+	tf.tf_a3 = 0;
+	tf.tf_epc += 4;
+
+	as_activate(curthread->t_vmspace);
+	mips_usermode(&tf);
+
+	panic("snapshot_thread: mips_usermode returned\n");
+}
+
+/*
+ * Start a new process from snapshot NAME. If RET is not NULL it gets
+ * the new thread, which is then joinable and must be thread_joined.
+ */
+int
+snapshot_spawn(const char *name, struct thread **ret)
+{
+	struct procsnap *ps;
+	struct snapstart *ss;
+	int result;
+
+	ss = kmalloc(sizeof(struct snapstart));
+	if (ss == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(snap_lock);
+	ps = snapshot_find(name);
+	if (ps == NULL) {
+		lock_release(snap_lock);
+		kfree(ss);
+		return ENOENT;
+	}
+
+	result = as_copy(ps->ps_as, &ss->ss_as);
+	if (result) {
+		lock_release(snap_lock);
+		kfree(ss);
+		return result;
+	}
+	ss->ss_tf = ps->ps_tf;
+	ss->ss_layout = *ps;
+	ss->ss_parent = curthread->pid;
+
+	if (ret != NULL) {
+		result = thread_fork_joinable(ps->ps_progname, ss, 0,
+					      snapshot_thread, ret);
+	}
+	else {
+		result = thread_fork(ps->ps_progname, ss, 0,
+				     snapshot_thread, NULL);
+	}
+	if (result) {
+		lock_release(snap_lock);
+		as_destroy(ss->ss_as);
+		kfree(ss);
+		return result;
+	}
+	snap_restored++;
+	lock_release(snap_lock);
+
+	return 0;
+}
+
+/*
+ * Drop snapshot NAME. Processes already started from it keep running;
+ * they hold their own references to its pages.
+ */
+int
+snapshot_delete(const char *name)
+{
+	struct procsnap **prev;
+	struct procsnap *ps;
+
+	lock_acquire(snap_lock);
+	for (prev = &snapshots; *prev != NULL; prev = &(*prev)->ps_next) {
+		ps = *prev;
+		if (!strcmp(ps->ps_name, name)) {
+			*prev = ps->ps_next;
+			lock_release(snap_lock);
+
+			as_destroy(ps->ps_as);
+			kfree(ps->ps_progname);
+			kfree(ps->ps_name);
+			kfree(ps);
+			return 0;
+		}
+	}
+	lock_release(snap_lock);
+	return ENOENT;
+}
+
+void
+snapshot_printstats(void)
+{
+	struct procsnap *ps;
+
+	lock_acquire(snap_lock);
+	for (ps = snapshots; ps != NULL; ps = ps->ps_next) {
+		kprintf("  %s: %s\n", ps->ps_name, ps->ps_progname);
+	}
+	kprintf("snapshots taken: %lu, processes restored: %lu\n",
+		snap_taken, snap_restored);
+	lock_release(snap_lock);
+}
@@ -13,6 +13,47 @@
 #include <kern/unistd.h>
 #include <vnode.h>
 
+/* page table entries freed per reaper pass before yielding */
+#define REAP_BATCH 32
+
+static struct addrspace * reap_head;
+
+/* every address space not yet destroyed, for disownframe */
+static struct addrspace * as_all;
+
+/*
+ * TLB management.
+ *
+ * Instead of flushing on every context switch, we remember whose entries
+ * are in the TLB (tlb_owner). Switching to a kernel thread and back, or
+ * to another thread of the same address space, leaves the TLB alone.
+ * Switching to a different address space first saves the valid entries
+ * of the outgoing one, newest first, and then reloads the newest
+ * TLBSNAP_MAX entries the incoming one had when it was switched out.
+ *
+ * as_activate(NULL) is what the VM calls whenever a mapping changes. It
+ * bumps tlb_generation, and a snapshot taken in an older generation is
+ * thrown away instead of being reloaded.
+ *
+ * New entries go into the TLB in FIFO order (tlb_next): invalid slots
+ * fill up first, then the oldest entry is replaced, rather than a
+ * random one.
+ */
+#define TLBSNAP_MAX (NUM_TLB/2)
+
+static int tlb_snapshots = 1;		/* save/restore on or off */
+static struct addrspace * tlb_owner;
+static unsigned tlb_generation = 1;
+static int tlb_next;
+
+/* statistics */
+static unsigned long tlb_refills;
+static unsigned long tlb_flushes;
+static unsigned long tlb_kept;		/* switches that kept the TLB as is */
+static unsigned long tlb_saved;		/* entries saved */
+static unsigned long tlb_restored;	/* entries reloaded */
+static unsigned long tlb_stale;		/* snapshots dropped by as_activate(NULL) */
+
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
@@ -45,6 +86,19 @@ as_create(void)
 	as->as_heapEnd = 0;	// end point of the heap
 	as->permissionv1 = 0;
 	as->permissionv2 = 0;
+	as->as_advice = NULL;	// madvise() ranges
+	as->as_reapnext = NULL;	// link on the reaper's queue
+	as->as_mmaps = NULL;	// mapped files
+	as->as_mmapnext = 0;	// where the next mapping goes
+	as->as_trace = NULL;	// exec fault trace being recorded
+	as->as_prefetched = 0;	// started from an exec trace
+	as->as_ntlb = 0;	// no saved TLB entries yet
+	as->as_tlbgen = 0;
+
+	int spl = splhigh();
+	as->as_next = as_all;
+	as_all = as;
+	splx(spl);
 	return as;
 }
 
@@ -71,6 +125,11 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	newas->permissionv2 = old->permissionv2;
 	newas->head = copypagetable(old, newas);
 
+	if(vm_advice_copy(old, newas) || mmap_copy(old, newas)){
+		as_destroy(newas);
+		return ENOMEM;
+	}
+
 	*ret = newas;
 	return 0;
 }
@@ -79,22 +138,153 @@ void
 as_destroy(struct addrspace *as)
 {
 	assert(as != NULL);	
-	deletepagetable(as);
-	kfree(as);
+	prefetch_purge(as);
+	vm_advice_destroy(as);
+	exectrace_finish(as);
+
+	//nothing of ours may stay in the TLB once the pages start going back
+	as_activate(NULL);
+
+	int spl = splhigh();
+	struct addrspace ** prev;
+	for(prev = &as_all; *prev != as; prev = &(*prev)->as_next){
+		assert(*prev != NULL);
+	}
+	*prev = as->as_next;
+
+	//hand the page table to the reaper thread
+	as->as_reapnext = reap_head;
+	reap_head = as;
+	thread_wakeup(&reap_head);
+	splx(spl);
+}
+
+/*
+ * Save the valid TLB entries into AS, newest first. Called at splhigh.
+ */
+static
+void
+tlb_save(struct addrspace *as)
+{
+	u_int32_t entryhi, entrylo;
+	int i, slot;
+
+	as->as_ntlb = 0;
+	for (i=1; i<=NUM_TLB && as->as_ntlb < TLBSNAP_MAX; i++) {
+		slot = (tlb_next - i + NUM_TLB) % NUM_TLB;
+		TLB_Read(&entryhi, &entrylo, slot);
+		if (entrylo & TLBLO_VALID) {
+			as->as_tlbhi[as->as_ntlb] = entryhi;
+			as->as_tlblo[as->as_ntlb] = entrylo;
+			as->as_ntlb++;
+		}
+	}
+	as->as_tlbgen = tlb_generation;
+	tlb_saved += as->as_ntlb;
+}
+
+/*
+ * Reload AS's saved entries, oldest first, so the newest are the last
+ * to be replaced. Called at splhigh right after a flush.
+ */
+static
+void
+tlb_restore(struct addrspace *as)
+{
+	int i;
+
+	if (as->as_tlbgen != tlb_generation) {
+		if (as->as_ntlb > 0) {
+			tlb_stale++;
+		}
+		as->as_ntlb = 0;
+		return;
+	}
+
+	for (i=as->as_ntlb-1; i>=0; i--) {
+		TLB_Write(as->as_tlbhi[i], as->as_tlblo[i], tlb_next);
+		tlb_next++;
+	}
+	tlb_restored += as->as_ntlb;
+	as->as_ntlb = 0;
 }
 
 void
 as_activate(struct addrspace *as)
 {
 	int i, spl;
-	(void)as;
 	spl = splhigh();
+
+	if (as != NULL && as == tlb_owner && tlb_snapshots) {
+		tlb_kept++;
+		splx(spl);
+		return;
+	}
+
+	if (as == NULL) {
+		//a mapping changed; any saved entries may be stale
+		tlb_generation++;
+	}
+	else if (tlb_owner != NULL && tlb_snapshots) {
+		tlb_save(tlb_owner);
+	}
+
 	for (i=0; i<NUM_TLB; i++) {
 		TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
+	tlb_next = 0;
+	tlb_flushes++;
+
+	//without an owner the TLB is empty until the next activation
+	tlb_owner = NULL;
+	if (as != NULL && tlb_snapshots) {
+		tlb_restore(as);
+		tlb_owner = as;
+	}
 	splx(spl);
 }
 
+/*
+ * Enter a new mapping after a TLB miss, replacing the oldest entry once
+ * every slot is in use.
+ */
+void
+tlb_replace(u_int32_t entryhi, u_int32_t entrylo)
+{
+	int spl = splhigh();
+
+	TLB_Write(entryhi, entrylo, tlb_next);
+	tlb_next = (tlb_next + 1) % NUM_TLB;
+	tlb_refills++;
+
+	splx(spl);
+}
+
+/*
+ * Turn TLB save/restore on or off, for comparing refill counts.
+ */
+void
+tlb_setsnapshots(int on)
+{
+	int spl = splhigh();
+	tlb_snapshots = on;
+	tlb_owner = NULL;
+	tlb_generation++;
+	splx(spl);
+}
+
+void
+tlb_printstats(void)
+{
+	kprintf("tlb: snapshots %s\n", tlb_snapshots ? "on" : "off");
+	kprintf("  refills:           %lu\n", tlb_refills);
+	kprintf("  flushes:           %lu\n", tlb_flushes);
+	kprintf("  switches kept:     %lu\n", tlb_kept);
+	kprintf("  entries saved:     %lu\n", tlb_saved);
+	kprintf("  entries restored:  %lu\n", tlb_restored);
+	kprintf("  stale snapshots:   %lu\n", tlb_stale);
+}
+
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
@@ -208,6 +398,7 @@ addentry(struct addrspace * as, vaddr_t vaddress, paddr_t paddress){
 	tempentry->vaddress = vaddress;
 	tempentry->paddress = paddress; 
 	tempentry->location = 0;
+	tempentry->busy = 0;
 	tempentry->ondisk = 0;
 	tempentry->count = 1;
 	// tempentry->next = NULL;
@@ -223,7 +414,11 @@ addentry(struct addrspace * as, vaddr_t vaddress, paddr_t paddress){
 	heapstart = as->as_heapStart;
 	heapend = as->as_heapEnd;
 	
-	if(vaddress >= vbase1 && vaddress < vtop1){
+	struct mmregion * mr = mmap_findregion(as, vaddress);
+
+	if(mr != NULL){
+		tempentry->permission = mr->mr_prot;
+	}else if(vaddress >= vbase1 && vaddress < vtop1){
 		tempentry->permission = as->permissionv1;
 	}else if(vaddress >= vbase2 && vaddress < vtop2){
 		tempentry->permission = as->permissionv2;
@@ -242,6 +437,57 @@ addentry(struct addrspace * as, vaddr_t vaddress, paddr_t paddress){
 	return tempentry; 
 }
 
+/*
+ * Put an existing entry into the page table of AS. The caller passes on
+ * its reference to the entry, and must have set entry->vaddress.
+ */
+int
+linkentry(struct addrspace * as, struct ptentry * tempentry){
+	struct ptlist * templist = (struct ptlist *)kmalloc(sizeof(struct ptlist));
+	if(templist == NULL){
+		return ENOMEM;
+	}
+
+	int spl = splhigh();
+	templist->entry = tempentry;
+	templist->next = as->head;
+	as->head = templist;
+	splx(spl);
+	return 0;
+}
+
+/*
+ * AS is about to stop sharing TEMPENTRY. The coremap names only one owner
+ * per frame, and swapout finds the entry through that owner's page table,
+ * so if the owner is AS the frame moves to another address space mapping
+ * the same entry. If only a pipe holds the other reference there is no
+ * such address space; the frame is pinned until pipe_mappage takes it or
+ * freeentry frees it. Called at splhigh.
+ */
+void
+disownframe(struct addrspace * as, struct ptentry * tempentry){
+	struct addrspace * other;
+	int index;
+
+	if(tempentry->ondisk == 1 || tempentry->count <= 1){
+		return;
+	}
+	index = tempentry->paddress/PAGE_SIZE;
+	if(coremap[index]->as != as || coremap[index]->vaddress != tempentry->vaddress){
+		return;
+	}
+
+	for(other = as_all; other != NULL; other = other->as_next){
+		if(other != as && findentry(other, tempentry->vaddress) == tempentry){
+			coremap[index]->as = other;
+			return;
+		}
+	}
+	coremap[index]->as = NULL;
+	coremap[index]->vaddress = 0;
+	coremap[index]->status = TRASH;
+}
+
 struct ptentry * 
 swapentry(struct addrspace * as, struct ptentry * oldentry, paddr_t paddress){
 	struct ptentry * tempentry = (struct ptentry *)kmalloc(sizeof(struct ptentry));
@@ -254,6 +500,7 @@ swapentry(struct addrspace * as, struct ptentry * oldentry, paddr_t paddress){
 	tempentry->vaddress = oldentry->vaddress;
 	tempentry->paddress = paddress; 
 	tempentry->location = 0;
+	tempentry->busy = 0;
 	tempentry->ondisk = 0;
 	tempentry->count = 1;
 	tempentry->permission = oldentry->permission;
@@ -288,10 +535,12 @@ copyentry(struct addrspace * as, struct ptentry * oldentry, paddr_t paddress){
 	tempentry->vaddress = oldentry->vaddress;
 	tempentry->paddress = paddress; 
 	tempentry->location = 0;
+	tempentry->busy = 0;
 	tempentry->ondisk = 0;
 	tempentry->count = 1;
 	tempentry->permission = oldentry->permission;
 
+	disownframe(as, oldentry);
 	oldentry->count --;
 	assert(oldentry->count != 0);
 
@@ -342,78 +591,216 @@ copypagetable(struct addrspace * old, struct addrspace * newas){
 	return newtable;
 }
 
+/*
+ * Drop one page table entry: free its frame and swap slot if we were the
+ * last user, otherwise just give up our reference.
+ */
+void
+freeentry(struct ptentry * todelete){
+	if(todelete->ondisk == 0){
+		if(todelete->count <= 1){
+			int index = todelete->paddress/PAGE_SIZE;
+
+			if(todelete->location != 0){
+				swap_free(todelete->location);
+			}
+
+			coremap[index]->as = NULL;
+			coremap[index]->vaddress = 0;
+			coremap[index]->status = FREE;
+			
+			kfree(todelete);
+		}else{
+			todelete->count --;
+		}
+	}else if(todelete->ondisk == 1){
+		assert(todelete->location > 0);
+		assert(swap_inuse(todelete->location));
+		if(todelete->count <=1 ){
+			swap_free(todelete->location);
+			kfree(todelete);
+		}
+		else{
+			todelete->count --;
+		}
+	}
+}
+
+/*
+ * Free up to NUM entries from the front of the page table of AS. Returns
+ * the number of frames given back to the coremap.
+ */
+int
+deletepagetable_batch(struct addrspace * as, int num){
+	struct ptlist * listdelete;
+	int freed = 0;
+
+	lock_acquire(page_lock);
+	int spl = splhigh();
+	while(as->head != NULL && num > 0){
+		listdelete = as->head;
+		if(listdelete->entry->busy){
+			//the prefetch thread is still reading it in
+			waitentry(listdelete->entry);
+			continue;
+		}
+		as->head = listdelete->next;
+
+		if(listdelete->entry->ondisk == 0 && listdelete->entry->count <= 1){
+			freed++;
+		}
+		disownframe(as, listdelete->entry);
+		freeentry(listdelete->entry);
+		listdelete->entry = NULL;
+
+		kfree(listdelete);
+		num--;
+	}
+	splx(spl);
+	lock_release(page_lock);
+	return freed;
+}
+
 void 
 deletepagetable(struct addrspace * as){
 	assert(as != NULL);	
-	struct ptlist * listdelete;
-	struct ptlist * templist;
-	struct ptentry * todelete;
 
 	as_activate(NULL);
-	lock_acquire(page_lock);
-	int spl = splhigh();
-	templist = as->head;
-	while(templist != NULL){
-		listdelete = templist; 
-		if(listdelete->entry->ondisk == 0){
+	while(as->head != NULL){
+		deletepagetable_batch(as, REAP_BATCH);
+	}
+}
 
-			if(listdelete->entry->location != 0 && listdelete->entry->count <=1){
-				offsetavailable[listdelete->entry->location] = 0;
-			}
+/*
+ * Address space reaper.
+ *
+ * as_destroy runs inside thread_exit with interrupts off, so it only
+ * queues the address space here. The reaper thread frees the page table
+ * REAP_BATCH entries at a time and yields in between, so frames come back
+ * to the coremap as it goes and other threads keep running.
+ */
+static unsigned long reap_spaces;
+static unsigned long reap_batches;
+static unsigned long reap_frames;
 
-			if(listdelete->entry->count <= 1){
-				int index = listdelete->entry->paddress/PAGE_SIZE;
-				todelete = listdelete->entry;
-
-				coremap[index]->as = NULL;
-				coremap[index]->vaddress = 0;
-				coremap[index]->status = FREE;
-				
-				kfree(todelete);
-			}else{
-				listdelete->entry->count --;
-			}
+static
+void
+reaper_thread(void * unused, unsigned long junk){
+	struct addrspace * as;
+	int spl;
 
-			listdelete->entry = NULL;
+	(void)unused;
+	(void)junk;
 
-		}else if(listdelete->entry->ondisk == 1){
-			assert(listdelete->entry->location > 0);
-			assert(offsetavailable[listdelete->entry->location] == 1);
-			if(listdelete->entry->count <=1 ){
-				offsetavailable[listdelete->entry->location] = 0;
-				todelete = listdelete->entry;
-				kfree(todelete);
-			}
-			else{
-				listdelete->entry->count --;
-			}
+	while(1){
+		spl = splhigh();
+		while(reap_head == NULL){
+			thread_sleep(&reap_head);
 		}
-		
-		templist = templist->next;
-		kfree(listdelete);		
+		as = reap_head;
+		reap_head = as->as_reapnext;
+		splx(spl);
+
+		//may write dirty file pages back, so not done in as_destroy
+		mmap_destroy(as);
+
+		while(as->head != NULL){
+			reap_frames += deletepagetable_batch(as, REAP_BATCH);
+			reap_batches++;
+			thread_yield();
+		}
+
+		kfree(as);
+		reap_spaces++;
+	}
+}
+
+void
+as_startreaper(void){
+	int result;
+
+	result = thread_fork("as reaper", NULL, 0, reaper_thread, NULL);
+	if(result){
+		panic("as: could not start reaper thread: %s\n", strerror(result));
+	}
+}
+
+void
+as_printstats(void){
+	int pending = 0;
+	struct addrspace * as;
+	int spl = splhigh();
+
+	for(as = reap_head; as != NULL; as = as->as_reapnext){
+		pending++;
 	}
-	as_activate(NULL);
 	splx(spl);
-	lock_release(page_lock);
-	as->head = NULL;
+
+	kprintf("address space reaper: %d pending\n", pending);
+	kprintf("  spaces reaped:     %lu\n", reap_spaces);
+	kprintf("  batches:           %lu\n", reap_batches);
+	kprintf("  frames freed:      %lu\n", reap_frames);
 }
 
+/*
+ * Wait for the swapin of TEMPENTRY another thread has in progress.
+ * page_lock is dropped while we sleep, so the caller has to look the
+ * page up again afterwards. Called with page_lock held.
+ */
+void
+waitentry(struct ptentry * tempentry){
+	int spl = splhigh();
+	lock_release(page_lock);
+	if(tempentry->busy){
+		thread_sleep(tempentry);
+	}
+	splx(spl);
+	lock_acquire(page_lock);
+}
 
+/*
+ * Read TEMPENTRY's page from swap into coremap frame SWAPINDEX. The
+ * entry is marked busy and page_lock is dropped for the read, so other
+ * processes keep faulting meanwhile; anyone else who wants the entry
+ * waits for it in waitentry. The frame is TRASH until the data is in.
+ * Called with page_lock held, from a fault in the current address space.
+ */
 void 
 swapin(struct ptentry * tempentry, int swapindex){
-	lock_acquire(core_lock);	
+	swapin_as(curthread->t_vmspace, tempentry, swapindex);
+}
+
+/*
+ * swapin for TEMPENTRY in the page table of AS, which need not be the
+ * current thread's (the prefetch thread has none).
+ */
+void
+swapin_as(struct addrspace * as, struct ptentry * tempentry, int swapindex){
 	int offset = tempentry->location; 
 	assert(offset > 0);
+	assert(lock_do_i_hold(page_lock) && !tempentry->busy);
 
-	struct uio tempuio; 
-	mk_kuio(&tempuio, (void *)PADDR_TO_KVADDR(swapindex*PAGE_SIZE), PAGE_SIZE, offset*PAGE_SIZE, UIO_READ);
+	int spl = splhigh();
+	tempentry->busy = 1;
+	coremap[swapindex]->as = NULL;
+	coremap[swapindex]->vaddress = 0;
+	coremap[swapindex]->status = TRASH;
+	coremap[swapindex]->obj = NULL;
+	splx(spl);
 
-	VOP_READ(bigswap, &tempuio);
-	
+	lock_release(page_lock);
+	int result = swap_read(offset, swapindex);
+	if(result){
+		kprintf("swap read failed Error: %d\n", result);
+	}
+	lock_acquire(page_lock);
+
+	lock_acquire(core_lock);	
+	spl = splhigh();
 	tempentry->paddress = swapindex * PAGE_SIZE;
 	tempentry->ondisk = 0;
 
-	coremap[swapindex]->as = curthread->t_vmspace;
+	coremap[swapindex]->as = as;
 	coremap[swapindex]->vaddress = tempentry->vaddress;
 	coremap[swapindex]->status = DIRTY;
 	
@@ -422,68 +809,156 @@ swapin(struct ptentry * tempentry, int swapindex){
 	gettime(&secs, &nsecs);
 	coremap[swapindex]->secs = secs;
 	coremap[swapindex]->nsecs = nsecs;
+
+	tempentry->busy = 0;
+	thread_wakeup(tempentry);
+	splx(spl);
 	lock_release(core_lock);
 }
 
-void swapout(int index){	
+/*
+ * Evict the page in coremap frame INDEX and leave the frame FREE. A user
+ * page is unmapped before it is written, so a fault on it during the
+ * write is served from the frame by the swap queue. If DROPLOCK is set
+ * page_lock, which the caller holds, is released for the write, and the
+ * caller's view of the page tables may be stale when we return. Object
+ * pages go to vmobject_evict with the lock held either way.
+ */
+static
+void
+swapout_common(int index, int droplock){
 	lock_acquire(core_lock);
 	if(coremap[index]->status == FREE){
 		lock_release(core_lock);
 		return;	
 	}
 
-	int offset = 0;	
-
-	struct ptlist * templist = coremap[index]->as->head;
-
-	while(templist != NULL){
-		if(templist->entry->vaddress == coremap[index]->vaddress){
-			offset = templist->entry->location;
-			break;
-		}
-		templist = templist->next;
+	//pages of a mapped file or other vm object are not in any page table
+	if(coremap[index]->obj != NULL){
+		vmobject_evict(index);
+		lock_release(core_lock);
+		return;
 	}
 
-	struct ptentry * tempentry = templist->entry;
+	struct ptentry * tempentry = findentry(coremap[index]->as, coremap[index]->vaddress);
+	assert(tempentry != NULL);
 
+	int offset = tempentry->location;
 	if(offset == 0){
-		int i;
-		for(i = 1; i < 1280; i++){
-			if(offsetavailable[i] == 0){
-				offset = i;				
-				offsetavailable[i] = 1;
-				break;
-			}
+		offset = swap_alloc();
+		if(offset == 0){
+			panic("swapout: out of swap\n");
 		}
 	}
 
-	struct uio tempuio; 
-	mk_kuio(&tempuio, (void *)PADDR_TO_KVADDR(index*PAGE_SIZE), PAGE_SIZE, offset*PAGE_SIZE, UIO_WRITE);
-
-	int result = VOP_WRITE(bigswap, &tempuio);
-	if(result){
-		kprintf("VOP WRITE FAILED Error: %d\n", result);
-	}
-
-	tempentry = findentry(coremap[index]->as, coremap[index]->vaddress);
-
+	int spl = splhigh();
 	tempentry->paddress = 0;
 	tempentry->location = offset; 
 	tempentry->ondisk = 1;
 	
 	coremap[index]->as = NULL;
 	coremap[index]->vaddress = 0;
-	coremap[index]->status = FREE;
+	coremap[index]->status = TRASH;
+
+	//Flush TLB
+	as_activate(NULL);
+	splx(spl);
+	lock_release(core_lock);
+
+	//tempentry may be freed while we wait; only the frame is ours now
+	if(droplock){
+		lock_release(page_lock);
+	}
+	int result = swap_write(offset, index);
+	if(result){
+		kprintf("VOP WRITE FAILED Error: %d\n", result);
+	}
+	if(droplock){
+		lock_acquire(page_lock);
+	}
 
 	time_t secs;	
 	u_int32_t nsecs;
 	gettime(&secs, &nsecs);
+	spl = splhigh();
+	coremap[index]->status = FREE;
 	coremap[index]->secs = secs;
 	coremap[index]->nsecs = nsecs;
+	splx(spl);
+}
 
-	//Flush TLB
+void swapout(int index){	
+	swapout_common(index, 0);
+}
+
+/*
+ * swapout, but let other threads use page_lock while the page is
+ * written. Called with page_lock held.
+ */
+void
+swapout_droplock(int index){
+	assert(lock_do_i_hold(page_lock));
+	swapout_common(index, 1);
+}
+
+/*
+ * Start evicting the page in coremap frame INDEX without waiting for the
+ * disk. The page table entry points at its swap slot straight away and
+ * the frame stays TRASH until the write finishes, when DONE(index,
+ * result) is called from the swap worker. A fault on the page meanwhile
+ * is served from the frame by the swap queue. Returns nonzero, having
+ * done nothing, if the frame cannot be evicted this way; the caller
+ * should fall back on swapout().
+ */
+int
+swapout_begin(int index, void (*done)(int, int)){
+	struct ptentry * tempentry;
+	int offset, result;
+
+	lock_acquire(core_lock);
+	if(coremap[index]->status != DIRTY || coremap[index]->obj != NULL ||
+	   coremap[index]->as == NULL){
+		lock_release(core_lock);
+		return EINVAL;
+	}
+
+	tempentry = findentry(coremap[index]->as, coremap[index]->vaddress);
+	assert(tempentry != NULL);
+
+	offset = tempentry->location;
+	if(offset == 0){
+		offset = swap_alloc();
+		if(offset == 0){
+			panic("swapout: out of swap\n");
+		}
+	}
+
+	//unmap first so nobody can change the page while it is written
+	int spl = splhigh();
+	tempentry->paddress = 0;
+	tempentry->location = offset;
+	tempentry->ondisk = 1;
+
+	coremap[index]->as = NULL;
+	coremap[index]->vaddress = 0;
+	coremap[index]->status = TRASH;
 	as_activate(NULL);
+	splx(spl);
+
+	result = swap_writeasync(offset, index, done);
+	if(result){
+		//no memory for the request; do it the slow way
+		result = swap_write(offset, index);
+		if(result){
+			kprintf("VOP WRITE FAILED Error: %d\n", result);
+		}
+		spl = splhigh();
+		done(index, result);
+		splx(spl);
+	}
+
 	lock_release(core_lock);
+	return 0;
 }
 
 void printtableandcore(struct addrspace * as, int table, int core){
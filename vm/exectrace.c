@@ -0,0 +1,284 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <curthread.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/spl.h>
+#include <machine/vm.h>
+#include <uio.h>
+#include <vnode.h>
+
+/*
+ * Exec-time prefetch.
+ *
+ * A freshly started program takes the same string of first-touch faults
+ * on its text and data every time, each one reading a single page out of
+ * the executable. The first time a binary runs we record the pages it
+ * demand-loads (up to EXECTRACE_MAX of them) against its vnode. When the
+ * process exits the record is kept, holding a reference to the vnode so
+ * the same vnode comes back on the next vfs_open. Later execs of that
+ * binary load every recorded page before going to user mode, reading
+ * runs of adjacent pages with a single VOP_READ.
+ *
+ * Records stay until reboot. Nothing is written to disk.
+ */
+
+#define EXECTRACE_MAX 64	/* pages recorded per binary */
+#define EXECTRACE_RUN 8		/* pages per read when prefetching */
+
+#define TEXT_BASE 0x400000
+#define DATA_BASE 0x10000000
+
+struct exectrace {
+	struct vnode * et_vnode;
+	int et_npages;
+	vaddr_t et_pages[EXECTRACE_MAX];	/* sorted */
+	struct exectrace * et_next;
+};
+
+/* finished records, one per binary */
+static struct exectrace * traces;
+
+/* statistics */
+static unsigned long et_recorded;	/* execs that recorded a trace */
+static unsigned long et_prefetched;	/* execs that used a trace */
+static unsigned long et_pages;		/* pages loaded ahead of time */
+static unsigned long et_reads;		/* VOP_READs to load them */
+static unsigned long et_misses;		/* demand loads after a prefetch */
+
+static
+struct exectrace *
+exectrace_lookup(struct vnode * v){
+	struct exectrace * et;
+
+	for(et = traces; et != NULL; et = et->et_next){
+		if(et->et_vnode == v){
+			return et;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Work out where in the executable the page at VADDR comes from, using
+ * the segment layout load_elf left in curthread. Returns the file offset
+ * and sets *FILEBYTES to how much of the page is backed by the file.
+ */
+static
+off_t
+exectrace_fileoffset(vaddr_t vaddr, int * filebytes){
+	int segoff, segfilesize;
+	off_t offset;
+
+	if(vaddr < DATA_BASE){
+		segoff = vaddr - TEXT_BASE;
+		offset = curthread->instoffset + segoff;
+		segfilesize = curthread->instfilesize;
+	}else{
+		segoff = vaddr - DATA_BASE;
+		offset = curthread->textoffset + segoff;
+		segfilesize = curthread->textfilesize;
+	}
+
+	*filebytes = segfilesize - segoff;
+	if(*filebytes < 0){
+		*filebytes = 0;
+	}else if(*filebytes > PAGE_SIZE){
+		*filebytes = PAGE_SIZE;
+	}
+	return offset;
+}
+
+/*
+ * Load the N recorded pages starting at PAGES[0], which are adjacent and
+ * in the same segment, with one read into BUF. Only free frames are
+ * used; we stop quietly if memory is short.
+ */
+static
+int
+exectrace_loadrun(struct addrspace * as, struct vnode * v, vaddr_t * pages,
+		  int n, char * buf){
+	struct uio ku;
+	struct ptentry * tempentry;
+	paddr_t paddress;
+	off_t offset;
+	int i, len, filebytes, index, result;
+
+	//the file backs a prefix of the run; everything after it is zero
+	offset = exectrace_fileoffset(pages[0], &filebytes);
+	len = 0;
+	for(i = 0; i < n; i++){
+		exectrace_fileoffset(pages[i], &filebytes);
+		len += filebytes;
+		if(filebytes < PAGE_SIZE){
+			break;
+		}
+	}
+
+	bzero(buf, n*PAGE_SIZE);
+	if(len > 0){
+		mk_kuio(&ku, buf, len, offset, UIO_READ);
+		result = VOP_READ(v, &ku);
+		if(result){
+			return result;
+		}
+		if(ku.uio_resid != 0){
+			return ENOEXEC;
+		}
+		et_reads++;
+	}
+
+	lock_acquire(page_lock);
+	for(i = 0; i < n; i++){
+		tempentry = findentry(as, pages[i]);
+		if(tempentry != NULL){
+			continue;
+		}
+		index = findavailablepage();
+		if(index == 0){
+			lock_release(page_lock);
+			return ENOMEM;
+		}
+		paddress = page_alloc(as, pages[i], index, 'v');
+		memcpy((void *)PADDR_TO_KVADDR(paddress), buf + i*PAGE_SIZE, PAGE_SIZE);
+		addentry(as, pages[i], paddress);
+		et_pages++;
+	}
+	lock_release(page_lock);
+
+	return 0;
+}
+
+static
+void
+exectrace_prefetch(struct exectrace * et, struct vnode * v){
+	struct addrspace * as = curthread->t_vmspace;
+	char * buf;
+	int i, n;
+
+	buf = kmalloc(EXECTRACE_RUN * PAGE_SIZE);
+	if(buf == NULL){
+		return;
+	}
+
+	for(i = 0; i < et->et_npages; i += n){
+		n = 1;
+		while(i + n < et->et_npages && n < EXECTRACE_RUN &&
+		      et->et_pages[i+n] == et->et_pages[i] + n*PAGE_SIZE &&
+		      (et->et_pages[i+n] < DATA_BASE) == (et->et_pages[i] < DATA_BASE)){
+			n++;
+		}
+		if(exectrace_loadrun(as, v, &et->et_pages[i], n, buf)){
+			break;
+		}
+	}
+
+	kfree(buf);
+	et_prefetched++;
+}
+
+/*
+ * Called from runprogram once load_elf has set up the segments of the
+ * executable V in the current address space. Prefetch from the binary's
+ * trace if it has one, otherwise start recording one.
+ */
+void
+exectrace_exec(struct vnode * v){
+	struct addrspace * as = curthread->t_vmspace;
+	struct exectrace * et;
+
+	et = exectrace_lookup(v);
+	if(et != NULL){
+		as->as_prefetched = 1;
+		exectrace_prefetch(et, v);
+		return;
+	}
+
+	et = kmalloc(sizeof(struct exectrace));
+	if(et == NULL){
+		return;
+	}
+	VOP_INCREF(v);
+	et->et_vnode = v;
+	et->et_npages = 0;
+	et->et_next = NULL;
+	as->as_trace = et;
+}
+
+/*
+ * Record that AS demand-loaded the page at VADDR from its executable.
+ * Called from vm_fault.
+ */
+void
+exectrace_fault(struct addrspace * as, vaddr_t vaddr){
+	struct exectrace * et = as->as_trace;
+	int i, j;
+
+	if(as->as_prefetched){
+		et_misses++;
+	}
+	if(et == NULL){
+		return;
+	}
+
+	for(i = 0; i < et->et_npages && et->et_pages[i] < vaddr; i++){
+		/* nothing */
+	}
+	if(i < et->et_npages && et->et_pages[i] == vaddr){
+		return;
+	}
+	for(j = et->et_npages; j > i; j--){
+		et->et_pages[j] = et->et_pages[j-1];
+	}
+	et->et_pages[i] = vaddr;
+	et->et_npages++;
+
+	if(et->et_npages == EXECTRACE_MAX){
+		exectrace_finish(as);
+	}
+}
+
+/*
+ * Stop recording for AS and keep what it recorded. Called when the trace
+ * fills up and from as_destroy.
+ */
+void
+exectrace_finish(struct addrspace * as){
+	struct exectrace * et = as->as_trace;
+
+	if(et == NULL){
+		return;
+	}
+	as->as_trace = NULL;
+
+	//another exec of the same binary may have finished first
+	if(et->et_npages == 0 || exectrace_lookup(et->et_vnode) != NULL){
+		VOP_DECREF(et->et_vnode);
+		kfree(et);
+		return;
+	}
+
+	et->et_next = traces;
+	traces = et;
+	et_recorded++;
+}
+
+void
+exectrace_printstats(void){
+	struct exectrace * et;
+	int n = 0;
+
+	for(et = traces; et != NULL; et = et->et_next){
+		n++;
+	}
+
+	kprintf("exec prefetch: %d binaries traced\n", n);
+	kprintf("  traces recorded:   %lu\n", et_recorded);
+	kprintf("  prefetched execs:  %lu\n", et_prefetched);
+	//every prefetched page is a startup fault the process does not take
+	kprintf("  faults avoided:    %lu (%lu reads)\n", et_pages, et_reads);
+	kprintf("  faults remaining:  %lu\n", et_misses);
+}
@@ -0,0 +1,277 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <curthread.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/spl.h>
+#include <machine/vm.h>
+#include <clock.h>
+
+/*
+ * Same-page merging.
+ *
+ * Forked processes tend to end up with byte-identical pages sitting in
+ * separate frames once copyentry has run. When enabled, the ksm thread
+ * walks the coremap every few seconds, hashes each resident user page and
+ * folds identical pages at the same virtual address into a single shared
+ * page table entry. The shared entry has count > 1, so the existing
+ * copy-on-write code in vm_fault splits it again on the first write.
+ *
+ * Only pages mapped at the same virtual address can be merged, because a
+ * ptentry carries its vaddress and is looked up by it.
+ */
+
+#define KSM_BUCKETS 64
+#define KSM_INTERVAL 2		/* seconds between passes */
+#define KSM_BATCH 16		/* pages hashed before letting others run */
+
+static int ksm_enabled;
+static struct thread * ksm_thread;
+
+/* per-pass hash table over coremap indexes, allocated on first pass */
+static u_int32_t * ksm_hash;
+static int * ksm_chain;
+static int ksm_bucket[KSM_BUCKETS];
+
+/* statistics */
+static unsigned long ksm_passes;
+static unsigned long ksm_scanned;
+static unsigned long ksm_merged;
+static time_t ksm_secs;		//scanning time, without yields
+static u_int32_t ksm_nsecs;
+
+static
+u_int32_t
+ksm_hashpage(int index){
+	const u_int32_t * words = (const u_int32_t *)PADDR_TO_KVADDR(index*PAGE_SIZE);
+	u_int32_t hash = 2166136261U;
+	unsigned i;
+
+	for(i = 0; i < PAGE_SIZE/sizeof(u_int32_t); i++){
+		hash ^= words[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Return the page table entry that maps coremap frame INDEX, or NULL if
+ * the frame is not a resident user page.
+ */
+static
+struct ptentry *
+ksm_frameentry(int index){
+	struct ptentry * tempentry;
+
+	if(coremap[index]->status != DIRTY || coremap[index]->as == NULL){
+		return NULL;
+	}
+	tempentry = findentry(coremap[index]->as, coremap[index]->vaddress);
+	if(tempentry == NULL || tempentry->ondisk == 1 ||
+	   tempentry->paddress != (paddr_t)index*PAGE_SIZE){
+		return NULL;
+	}
+	return tempentry;
+}
+
+/*
+ * Point the page table of coremap[dup]'s owner at KEEP's entry, free
+ * frame DUP and flush the TLB. Called with page_lock held and interrupts
+ * off, after the contents have been compared.
+ */
+static
+void
+ksm_merge(struct ptentry * keep, int dup){
+	struct addrspace * as = coremap[dup]->as;
+	struct ptlist * templist;
+	struct ptentry * dupentry = NULL;
+
+	for(templist = as->head; templist != NULL; templist = templist->next){
+		if(templist->entry->vaddress == coremap[dup]->vaddress){
+			dupentry = templist->entry;
+			break;
+		}
+	}
+	assert(dupentry != NULL && dupentry->count == 1);
+
+	templist->entry = keep;
+	keep->count++;
+
+	if(dupentry->location != 0){
+		swap_free(dupentry->location);
+	}
+	kfree(dupentry);
+
+	coremap[dup]->as = NULL;
+	coremap[dup]->vaddress = 0;
+	coremap[dup]->status = FREE;
+	coremap[dup]->secs = 0;
+	coremap[dup]->nsecs = 0;
+
+	//KEEP is shared now and must fault on write, and DUP's frame is gone.
+	//Flush before anything else runs: ksm_pass yields with other address
+	//spaces' entries still in the TLB.
+	as_activate(NULL);
+	ksm_merged++;
+}
+
+/*
+ * Add the time since BEFORESECS/BEFORENSECS to the scan time.
+ */
+static
+void
+ksm_addtime(time_t beforesecs, u_int32_t beforensecs){
+	time_t aftersecs, secs;
+	u_int32_t afternsecs, nsecs;
+
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs, &secs, &nsecs);
+	ksm_secs += secs;
+	ksm_nsecs += nsecs;
+	if(ksm_nsecs >= 1000000000){
+		ksm_nsecs -= 1000000000;
+		ksm_secs++;
+	}
+}
+
+static
+void
+ksm_pass(void){
+	time_t beforesecs;
+	u_int32_t beforensecs;
+	struct ptentry * tempentry;
+	struct ptentry * other;
+	int i, j, b, spl, hashed = 0;
+
+	for(b = 0; b < KSM_BUCKETS; b++){
+		ksm_bucket[b] = -1;
+	}
+
+	//Only the stretches between yields are timed, starting once page_lock
+	//is ours, so other threads' time and lock waits are not counted.
+	lock_acquire(page_lock);
+	gettime(&beforesecs, &beforensecs);
+	for(i = num_trash + 1; i < totalnumpages - 1; i++){
+		spl = splhigh();
+
+		tempentry = ksm_frameentry(i);
+		if(tempentry == NULL){
+			splx(spl);
+			continue;
+		}
+
+		ksm_scanned++;
+		hashed++;
+		ksm_hash[i] = ksm_hashpage(i);
+		b = ksm_hash[i] % KSM_BUCKETS;
+
+		for(j = ksm_bucket[b]; j != -1; j = ksm_chain[j]){
+			if(ksm_hash[j] != ksm_hash[i] ||
+			   coremap[j]->vaddress != coremap[i]->vaddress ||
+			   coremap[j]->as == coremap[i]->as){
+				continue;
+			}
+			//frame j may have been swapped out since we hashed it
+			other = ksm_frameentry(j);
+			if(other == NULL || other == tempentry){
+				continue;
+			}
+			if(memcmp((const void *)PADDR_TO_KVADDR(i*PAGE_SIZE),
+				  (const void *)PADDR_TO_KVADDR(j*PAGE_SIZE), PAGE_SIZE) != 0){
+				continue;
+			}
+			if(tempentry->count == 1){
+				ksm_merge(other, i);
+				break;
+			}
+		}
+
+		if(j == -1){
+			ksm_chain[i] = ksm_bucket[b];
+			ksm_bucket[b] = i;
+		}
+		splx(spl);
+
+		if(hashed == KSM_BATCH){
+			hashed = 0;
+			ksm_addtime(beforesecs, beforensecs);
+			lock_release(page_lock);
+			thread_yield();
+			lock_acquire(page_lock);
+			gettime(&beforesecs, &beforensecs);
+		}
+	}
+
+	ksm_addtime(beforesecs, beforensecs);
+	lock_release(page_lock);
+	ksm_passes++;
+}
+
+static
+void
+ksm_run(void * unused, unsigned long junk){
+	int spl;
+
+	(void)unused;
+	(void)junk;
+
+	while(1){
+		spl = splhigh();
+		while(ksm_enabled == 0){
+			thread_sleep(&ksm_enabled);
+		}
+		splx(spl);
+
+		ksm_pass();
+		clocksleep(KSM_INTERVAL);
+	}
+}
+
+/*
+ * Turn the scanner on or off. The thread is started the first time.
+ */
+int
+ksm_enable(int on){
+	int result, spl;
+
+	if(on && ksm_thread == NULL){
+		ksm_hash = kmalloc(totalnumpages * sizeof(u_int32_t));
+		ksm_chain = kmalloc(totalnumpages * sizeof(int));
+		if(ksm_hash == NULL || ksm_chain == NULL){
+			kfree(ksm_hash);
+			kfree(ksm_chain);
+			ksm_hash = NULL;
+			ksm_chain = NULL;
+			return ENOMEM;
+		}
+		result = thread_fork("ksm", NULL, 0, ksm_run, &ksm_thread);
+		if(result){
+			kfree(ksm_hash);
+			kfree(ksm_chain);
+			ksm_hash = NULL;
+			ksm_chain = NULL;
+			return result;
+		}
+	}
+
+	spl = splhigh();
+	ksm_enabled = on;
+	if(on){
+		thread_wakeup(&ksm_enabled);
+	}
+	splx(spl);
+	return 0;
+}
+
+void
+ksm_printstats(void){
+	kprintf("ksm: %s\n", ksm_enabled ? "on" : "off");
+	kprintf("  passes:        %lu\n", ksm_passes);
+	kprintf("  pages scanned: %lu\n", ksm_scanned);
+	kprintf("  frames merged: %lu\n", ksm_merged);
+	kprintf("  time scanning: %lu.%09lu seconds (excluding yields)\n",
+		(unsigned long) ksm_secs, (unsigned long) ksm_nsecs);
+}
@@ -0,0 +1,386 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <kern/unistd.h>
+#include <kern/limits.h>
+#include <lib.h>
+#include <thread.h>
+#include <curthread.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/spl.h>
+#include <machine/tlb.h>
+#include <machine/vm.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <tmpfs.h>
+
+/*
+ * Memory-mapped files.
+ *
+ * mmap() adds a region to the address space backed by the vmobject of the
+ * file, so every process mapping the same file sees the same frames.
+ * Shared mappings map the object's frames straight into the TLB and never
+ * enter the page table; writes mark the page dirty so it gets written back
+ * on eviction, msync or the last munmap. Private mappings copy the object
+ * page into an ordinary anonymous page on first touch, after which the
+ * regular vm_fault and swap code take over.
+ *
+ * Mappings are placed upwards from MMAP_BASE, between the heap and the
+ * area vm_fault treats as stack growth.
+ */
+
+#define MMAP_BASE 0x60000000
+#define MMAP_TOP  0x70000000
+
+/*
+ * Find the mapping containing VADDRESS, or NULL.
+ */
+struct mmregion *
+mmap_findregion(struct addrspace * as, vaddr_t vaddress){
+	struct mmregion * mr;
+
+	for(mr = as->as_mmaps; mr != NULL; mr = mr->mr_next){
+		if(vaddress >= mr->mr_start && vaddress < mr->mr_end){
+			return mr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Fault handler for mapped regions, called from vm_fault before the
+ * regular region checks. Sets *HANDLED to 0 when the page is a private
+ * copy that is already in the page table, in which case vm_fault deals
+ * with it like any other anonymous page.
+ */
+int
+mmap_fault(struct addrspace * as, struct mmregion * mr, int faulttype,
+	   vaddr_t faultaddress, int * handled){
+	u_int32_t entrylo;
+	paddr_t paddress;
+	int pgno, objindex, index, result;
+	int spare = 0;
+
+	*handled = 1;
+
+	if(faulttype != VM_FAULT_READ && (mr->mr_prot & PROT_WRITE) == 0){
+		return EFAULT;
+	}
+
+	pgno = mr->mr_offset/PAGE_SIZE + (faultaddress - mr->mr_start)/PAGE_SIZE;
+	if(pgno < 0 || pgno >= mr->mr_obj->vo_npages){
+		return EFAULT;
+	}
+
+	lock_acquire(page_lock);
+
+	//both vmobject_getpage and fault_getframe may let go of page_lock to
+	//evict a page, so look at the page table again whenever they have
+ retry:
+	if(mr->mr_flags & MAP_PRIVATE){
+		if(findentry(as, faultaddress) != NULL){
+			fault_putframe(&spare);
+			lock_release(page_lock);
+			*handled = 0;
+			return 0;
+		}
+
+		objindex = vmobject_getpage(mr->mr_obj, pgno);
+		if(objindex == 0){
+			fault_putframe(&spare);
+			lock_release(page_lock);
+			return EIO;
+		}
+		if(findentry(as, faultaddress) != NULL){
+			goto retry;
+		}
+
+		//the object page may be evicted too if this drops the lock
+		index = fault_getframe(&spare);
+		if(index < 0){
+			goto retry;
+		}
+		if(index == 0){
+			lock_release(page_lock);
+			return ENOMEM;
+		}
+		paddress = page_alloc(as, faultaddress, index, 'm');
+		memcpy((void *)PADDR_TO_KVADDR(paddress), (const void *)PADDR_TO_KVADDR(objindex*PAGE_SIZE), PAGE_SIZE);
+		addentry(as, faultaddress, paddress);
+
+		entrylo = paddress;
+		entrylo |= TLBLO_VALID;
+		if(faulttype != VM_FAULT_READ){
+			entrylo |= TLBLO_DIRTY;
+		}
+	}else{
+		objindex = vmobject_getpage(mr->mr_obj, pgno);
+		if(objindex == 0){
+			lock_release(page_lock);
+			return EIO;
+		}
+
+		//map clean first so the first write tells us the page is dirty
+		entrylo = objindex*PAGE_SIZE;
+		entrylo |= TLBLO_VALID;
+		if(faulttype != VM_FAULT_READ){
+			vmobject_setdirty(mr->mr_obj, pgno);
+			entrylo |= TLBLO_DIRTY;
+		}
+	}
+
+	int spl = splhigh();
+	result = TLB_Probe(faultaddress, 0);
+	if(result < 0){
+		tlb_replace(faultaddress, entrylo);
+	}else{
+		TLB_Write(faultaddress, entrylo, result);
+	}
+	splx(spl);
+
+	lock_release(page_lock);
+	return 0;
+}
+
+/*
+ * Copy the mappings of OLD into NEWAS on fork. Private pages already
+ * touched were copied along with the page table.
+ */
+int
+mmap_copy(struct addrspace * old, struct addrspace * newas){
+	struct mmregion * mr;
+	struct mmregion * newmr;
+
+	newas->as_mmapnext = old->as_mmapnext;
+	for(mr = old->as_mmaps; mr != NULL; mr = mr->mr_next){
+		newmr = kmalloc(sizeof(struct mmregion));
+		if(newmr == NULL){
+			return ENOMEM;
+		}
+		*newmr = *mr;
+		newmr->mr_obj->vo_refcount++;
+		newmr->mr_next = newas->as_mmaps;
+		newas->as_mmaps = newmr;
+	}
+	return 0;
+}
+
+/*
+ * Tear down all mappings of AS. Called by the reaper, which is allowed
+ * to sleep for the writeback.
+ */
+void
+mmap_destroy(struct addrspace * as){
+	struct mmregion * mr;
+
+	lock_acquire(page_lock);
+	while(as->as_mmaps != NULL){
+		mr = as->as_mmaps;
+		as->as_mmaps = mr->mr_next;
+		vmobject_release(mr->mr_obj);
+		kfree(mr);
+	}
+	lock_release(page_lock);
+}
+
+/*
+ * Add a mapping of NPAGES pages of OBJ, starting at page-aligned object
+ * offset OFFSET, to AS. The region takes over the caller's reference to
+ * OBJ. Returns the start address in *RETVAL.
+ */
+int
+mmap_addregion(struct addrspace * as, struct vmobject * obj, size_t npages,
+	       int prot, int flags, off_t offset, vaddr_t * retval){
+	struct mmregion * mr;
+
+	if(as->as_mmapnext == 0){
+		as->as_mmapnext = MMAP_BASE;
+	}
+	if(npages > (MMAP_TOP - as->as_mmapnext) / PAGE_SIZE){
+		return ENOMEM;
+	}
+
+	mr = kmalloc(sizeof(struct mmregion));
+	if(mr == NULL){
+		return ENOMEM;
+	}
+
+	mr->mr_start = as->as_mmapnext;
+	mr->mr_end = mr->mr_start + npages * PAGE_SIZE;
+	mr->mr_prot = prot;
+	mr->mr_flags = flags;
+	mr->mr_obj = obj;
+	mr->mr_offset = offset;
+	mr->mr_next = as->as_mmaps;
+	as->as_mmaps = mr;
+	as->as_mmapnext = mr->mr_end;
+
+	*retval = mr->mr_start;
+	return 0;
+}
+
+/*
+ * Remove the mapping starting at START from AS and drop its object
+ * reference. If NPAGES is nonzero it must match the size of the mapping.
+ */
+int
+mmap_removeregion(struct addrspace * as, vaddr_t start, size_t npages){
+	struct mmregion ** prev;
+	struct mmregion * mr;
+
+	for(prev = &as->as_mmaps; *prev != NULL; prev = &(*prev)->mr_next){
+		mr = *prev;
+		if(mr->mr_start != start){
+			continue;
+		}
+		if(npages != 0 && npages != (mr->mr_end - mr->mr_start) / PAGE_SIZE){
+			return EINVAL;
+		}
+
+		*prev = mr->mr_next;
+		if(mr->mr_flags & MAP_PRIVATE){
+			vm_dropentries(as, mr->mr_start, mr->mr_end);
+		}
+
+		lock_acquire(page_lock);
+		vmobject_release(mr->mr_obj);
+		as_activate(NULL);
+		lock_release(page_lock);
+
+		kfree(mr);
+		return 0;
+	}
+	return EINVAL;
+}
+
+/*
+ * mmap() system call. Maps LEN bytes of the file PATH starting at the
+ * page-aligned OFFSET. There is no file table in this kernel, so the
+ * file is named by path rather than by descriptor.
+ */
+int
+sys_mmap(userptr_t path, size_t len, int prot, int flags, off_t offset, vaddr_t * retval){
+	struct addrspace * as = curthread->t_vmspace;
+	char kpath[PATH_MAX];
+	struct vnode * v;
+	struct stat st;
+	struct vmobject * obj;
+	size_t npages;
+	int result, filepages;
+
+	if(as == NULL){
+		return EFAULT;
+	}
+	if(len == 0 || offset < 0 || (offset % PAGE_SIZE) != 0){
+		return EINVAL;
+	}
+	if((flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+	   (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE)){
+		return EINVAL;
+	}
+	if((prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) != 0){
+		return EINVAL;
+	}
+
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	result = copyinstr(path, kpath, sizeof(kpath), NULL);
+	if(result){
+		return result;
+	}
+
+	//only a shared writable mapping ever writes to the file
+	result = vfs_open(kpath, ((flags & MAP_SHARED) && (prot & PROT_WRITE)) ? O_RDWR : O_RDONLY, &v);
+	if(result){
+		return result;
+	}
+
+	//tmpfs takes page_lock to read and write, which vmobject already holds
+	if(tmpfs_isfile(v)){
+		vfs_close(v);
+		return ENODEV;
+	}
+
+	result = VOP_STAT(v, &st);
+	if(result){
+		vfs_close(v);
+		return result;
+	}
+	filepages = (st.st_size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if(offset/PAGE_SIZE + npages > (size_t)filepages){
+		vfs_close(v);
+		return EINVAL;
+	}
+
+	lock_acquire(page_lock);
+	obj = vmobject_lookup(v, filepages);
+	if(obj == NULL){
+		lock_release(page_lock);
+		vfs_close(v);
+		return ENOMEM;
+	}
+
+	result = mmap_addregion(as, obj, npages, prot, flags, offset, retval);
+	if(result){
+		vmobject_release(obj);
+	}
+	lock_release(page_lock);
+	return result;
+}
+
+/*
+ * munmap() system call. Only whole mappings can be unmapped.
+ */
+int
+sys_munmap(userptr_t addr, size_t len){
+	struct addrspace * as = curthread->t_vmspace;
+
+	if(as == NULL){
+		return EFAULT;
+	}
+	if(len == 0){
+		return EINVAL;
+	}
+	return mmap_removeregion(as, (vaddr_t)addr, (len + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
+/*
+ * msync() system call. Writes back the dirty pages of every shared
+ * mapping overlapping [ADDR, ADDR+LEN).
+ */
+int
+sys_msync(userptr_t addr, size_t len){
+	struct addrspace * as = curthread->t_vmspace;
+	struct mmregion * mr;
+	vaddr_t start = (vaddr_t)addr;
+	vaddr_t end = start + len;
+	vaddr_t lo, hi;
+	int result;
+
+	if(as == NULL){
+		return EFAULT;
+	}
+	if((start % PAGE_SIZE) != 0 || end < start){
+		return EINVAL;
+	}
+
+	lock_acquire(page_lock);
+	for(mr = as->as_mmaps; mr != NULL; mr = mr->mr_next){
+		if((mr->mr_flags & MAP_SHARED) == 0 || mr->mr_end <= start || mr->mr_start >= end){
+			continue;
+		}
+		lo = start > mr->mr_start ? start : mr->mr_start;
+		hi = end < mr->mr_end ? end : mr->mr_end;
+		result = vmobject_sync(mr->mr_obj,
+				       mr->mr_offset/PAGE_SIZE + (lo - mr->mr_start)/PAGE_SIZE,
+				       mr->mr_offset/PAGE_SIZE + (hi - mr->mr_start + PAGE_SIZE - 1)/PAGE_SIZE);
+		if(result){
+			lock_release(page_lock);
+			return result;
+		}
+	}
+	lock_release(page_lock);
+	return 0;
+}
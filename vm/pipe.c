@@ -0,0 +1,657 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <curthread.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/spl.h>
+#include <machine/vm.h>
+#include <clock.h>
+#include <uio.h>
+#include <vnode.h>
+
+/*
+ * Page-flipping pipes.
+ *
+ * A write of a whole, page-aligned user page does not copy anything: the
+ * pipe takes a reference on the writer's page table entry, which makes
+ * the page copy-on-write for the writer, and the flushed TLB makes sure
+ * the next store faults. The reader then gets the page put straight into
+ * its page table:
+ *
+ *  - if the writer has already written over its copy, the pipe holds the
+ *    only reference and the entry is simply moved to the reader's address;
+ *  - if the reader's buffer is at the same address as the writer's (the
+ *    usual case between forks of one parent) the entry is shared, exactly
+ *    like after fork;
+ *  - otherwise the page is copied out after all.
+ *
+ * Small or unaligned transfers go through a kernel buffer, two copies per
+ * byte like any other pipe.
+ *
+ * There is no file table in this kernel, so pipes are named by a small
+ * integer handed out by pipe_create.
+ */
+
+#define PIPE_MAX 32		/* pipes in the system */
+#define PIPE_CHUNKS 16		/* pages of data a pipe can hold */
+
+struct pipechunk {
+	struct ptentry * pc_entry;	/* flipped page, or NULL */
+	char * pc_buf;			/* copied data otherwise */
+	size_t pc_len;
+	size_t pc_off;			/* bytes already read */
+	struct pipechunk * pc_next;
+};
+
+struct pipe {
+	struct lock * p_lock;
+	struct cv * p_cv;
+	struct pipechunk * p_head;
+	struct pipechunk * p_tail;
+	int p_nchunks;
+	int p_closed;
+	int p_refcount;			/* pipes[] slot plus threads inside */
+};
+
+static struct pipe * pipes[PIPE_MAX];
+
+/* statistics */
+static unsigned long pipe_flipped;
+static unsigned long pipe_shared;
+static unsigned long pipe_copied;
+static unsigned long pipe_unflipped;	/* flippable pages copied on read */
+
+/*
+ * Look up pipe ID and take a reference on it, so it stays around while
+ * we use it even if somebody closes it. Drop it with pipe_put.
+ */
+static
+struct pipe *
+pipe_get(int id){
+	struct pipe * p;
+	int spl;
+
+	if(id < 0 || id >= PIPE_MAX){
+		return NULL;
+	}
+	spl = splhigh();
+	p = pipes[id];
+	if(p != NULL){
+		p->p_refcount++;
+	}
+	splx(spl);
+	return p;
+}
+
+/*
+ * Drop a reference; the last one frees the pipe.
+ */
+static
+void
+pipe_put(struct pipe * p){
+	int spl;
+
+	spl = splhigh();
+	assert(p->p_refcount > 0);
+	p->p_refcount--;
+	if(p->p_refcount > 0){
+		splx(spl);
+		return;
+	}
+	splx(spl);
+
+	assert(p->p_head == NULL);
+	lock_destroy(p->p_lock);
+	cv_destroy(p->p_cv);
+	kfree(p);
+}
+
+int
+pipe_create(int * retval){
+	struct pipe * p;
+	int id, spl;
+
+	p = kmalloc(sizeof(struct pipe));
+	if(p == NULL){
+		return ENOMEM;
+	}
+	p->p_lock = lock_create("pipe");
+	p->p_cv = cv_create("pipe");
+	if(p->p_lock == NULL || p->p_cv == NULL){
+		if(p->p_lock != NULL){
+			lock_destroy(p->p_lock);
+		}
+		if(p->p_cv != NULL){
+			cv_destroy(p->p_cv);
+		}
+		kfree(p);
+		return ENOMEM;
+	}
+	p->p_head = NULL;
+	p->p_tail = NULL;
+	p->p_nchunks = 0;
+	p->p_closed = 0;
+	p->p_refcount = 1;
+
+	spl = splhigh();
+	for(id = 0; id < PIPE_MAX; id++){
+		if(pipes[id] == NULL){
+			pipes[id] = p;
+			splx(spl);
+			*retval = id;
+			return 0;
+		}
+	}
+	splx(spl);
+
+	lock_destroy(p->p_lock);
+	cv_destroy(p->p_cv);
+	kfree(p);
+	return ENFILE;
+}
+
+/*
+ * Give up the pipe's reference to a flipped page.
+ */
+static
+void
+pipe_putpage(struct ptentry * tempentry){
+	lock_acquire(page_lock);
+	int spl = splhigh();
+	freeentry(tempentry);
+	splx(spl);
+	lock_release(page_lock);
+}
+
+/*
+ * Take a reference on the page of AS at VADDRESS so it can be handed to
+ * a reader. Returns NULL if the page has never been touched.
+ */
+static
+struct ptentry *
+pipe_grabpage(struct addrspace * as, vaddr_t vaddress){
+	struct ptentry * tempentry;
+
+	lock_acquire(page_lock);
+	int spl = splhigh();
+	tempentry = findentry(as, vaddress);
+	if(tempentry != NULL){
+		tempentry->count++;
+		//the writer must fault on its next store to get its own copy
+		as_activate(NULL);
+	}
+	splx(spl);
+	lock_release(page_lock);
+	return tempentry;
+}
+
+/*
+ * Try to put the flipped page TEMPENTRY into AS at VADDRESS without
+ * copying. Consumes the pipe's reference on success.
+ */
+static
+int
+pipe_mappage(struct addrspace * as, struct ptentry * tempentry, vaddr_t vaddress){
+	time_t secs;
+	u_int32_t nsecs;
+
+	if(!(vaddress >= as->as_heapStart && vaddress < as->as_heapEnd) &&
+	   !(vaddress >= as->as_stackvbase && vaddress < USERSTACK)){
+		return EINVAL;
+	}
+	if(tempentry->count > 1 && tempentry->vaddress != vaddress){
+		return EINVAL;
+	}
+
+	//whatever the reader had there is about to be overwritten anyway; if it
+	//was shared copy-on-write this only drops the reader's reference
+	vm_dropentries(as, vaddress, vaddress + PAGE_SIZE);
+
+	lock_acquire(page_lock);
+	if(findentry(as, vaddress) != NULL){
+		lock_release(page_lock);
+		return EBUSY;
+	}
+
+	int spl = splhigh();
+	if(tempentry->count == 1){
+		tempentry->vaddress = vaddress;
+		tempentry->permission = 7;
+		pipe_flipped++;
+	}else{
+		pipe_shared++;
+	}
+	if(linkentry(as, tempentry)){
+		splx(spl);
+		lock_release(page_lock);
+		return ENOMEM;
+	}
+	if(tempentry->ondisk == 0 && coremap[tempentry->paddress/PAGE_SIZE]->as == NULL){
+		//the frame was disowned when the writer broke COW or went away
+		int index = tempentry->paddress/PAGE_SIZE;
+		coremap[index]->status = DIRTY;
+		coremap[index]->as = as;
+		coremap[index]->vaddress = vaddress;
+		gettime(&secs, &nsecs);
+		coremap[index]->secs = secs;
+		coremap[index]->nsecs = nsecs;
+	}
+	as_activate(NULL);
+	splx(spl);
+	lock_release(page_lock);
+	return 0;
+}
+
+/*
+ * Copy LEN bytes at offset OFF of a flipped page out to user address
+ * UBUF. Used when the page cannot be mapped at the reader's address.
+ */
+static
+int
+pipe_copypage(struct ptentry * tempentry, size_t off, userptr_t ubuf, size_t len){
+	char * kbuf;
+	int result;
+
+	kbuf = kmalloc(PAGE_SIZE);
+	if(kbuf == NULL){
+		return ENOMEM;
+	}
+
+	lock_acquire(page_lock);
+	if(tempentry->ondisk == 0){
+		memcpy(kbuf, (const void *)PADDR_TO_KVADDR(tempentry->paddress), PAGE_SIZE);
+	}else{
+		swap_readbuf(tempentry->location, kbuf);
+	}
+	lock_release(page_lock);
+
+	result = copyout(kbuf + off, ubuf, len);
+	kfree(kbuf);
+	return result;
+}
+
+/*
+ * Write LEN bytes from user address UBUF. Blocks while the pipe is full.
+ */
+int
+pipe_write(int id, userptr_t ubuf, size_t len, size_t * retval){
+	struct addrspace * as = curthread->t_vmspace;
+	struct pipe * p = pipe_get(id);
+	struct pipechunk * chunk;
+	vaddr_t vaddress;
+	size_t n, done = 0;
+	int result;
+
+	if(p == NULL){
+		return EBADF;
+	}
+
+	while(done < len){
+		vaddress = (vaddr_t)ubuf + done;
+
+		chunk = kmalloc(sizeof(struct pipechunk));
+		if(chunk == NULL){
+			result = ENOMEM;
+			goto out;
+		}
+		chunk->pc_entry = NULL;
+		chunk->pc_buf = NULL;
+		chunk->pc_off = 0;
+		chunk->pc_next = NULL;
+
+		if(as != NULL && (vaddress % PAGE_SIZE) == 0 && len - done >= PAGE_SIZE){
+			chunk->pc_entry = pipe_grabpage(as, vaddress);
+		}
+
+		if(chunk->pc_entry != NULL){
+			chunk->pc_len = PAGE_SIZE;
+		}else{
+			n = len - done;
+			if(n > PAGE_SIZE){
+				n = PAGE_SIZE;
+			}
+			chunk->pc_buf = kmalloc(n);
+			if(chunk->pc_buf == NULL){
+				kfree(chunk);
+				result = ENOMEM;
+				goto out;
+			}
+			result = copyin((const_userptr_t)vaddress, chunk->pc_buf, n);
+			if(result){
+				kfree(chunk->pc_buf);
+				kfree(chunk);
+				goto out;
+			}
+			chunk->pc_len = n;
+			pipe_copied++;
+		}
+
+		lock_acquire(p->p_lock);
+		while(p->p_nchunks >= PIPE_CHUNKS && !p->p_closed){
+			cv_wait(p->p_cv, p->p_lock);
+		}
+		if(p->p_closed){
+			lock_release(p->p_lock);
+			if(chunk->pc_entry != NULL){
+				pipe_putpage(chunk->pc_entry);
+			}
+			kfree(chunk->pc_buf);
+			kfree(chunk);
+			result = EPIPE;
+			goto out;
+		}
+		if(p->p_tail == NULL){
+			p->p_head = chunk;
+		}else{
+			p->p_tail->pc_next = chunk;
+		}
+		p->p_tail = chunk;
+		p->p_nchunks++;
+		cv_broadcast(p->p_cv, p->p_lock);
+		lock_release(p->p_lock);
+
+		done += chunk->pc_len;
+	}
+	result = 0;
+
+ out:
+	pipe_put(p);
+	*retval = done;
+	return done > 0 ? 0 : result;
+}
+
+/*
+ * Read up to LEN bytes into user address UBUF. Blocks until there is
+ * some data or the pipe is closed; returns 0 bytes at end of file.
+ */
+int
+pipe_read(int id, userptr_t ubuf, size_t len, size_t * retval){
+	struct addrspace * as = curthread->t_vmspace;
+	struct pipe * p = pipe_get(id);
+	struct pipechunk * chunk;
+	vaddr_t vaddress;
+	size_t n, done = 0;
+	int result = 0;
+
+	if(p == NULL){
+		return EBADF;
+	}
+
+	lock_acquire(p->p_lock);
+	while(p->p_head == NULL && !p->p_closed){
+		cv_wait(p->p_cv, p->p_lock);
+	}
+
+	while(done < len && p->p_head != NULL){
+		chunk = p->p_head;
+		vaddress = (vaddr_t)ubuf + done;
+		n = chunk->pc_len - chunk->pc_off;
+		if(n > len - done){
+			n = len - done;
+		}
+
+		if(chunk->pc_entry != NULL && chunk->pc_off == 0 && n == PAGE_SIZE &&
+		   as != NULL && (vaddress % PAGE_SIZE) == 0 &&
+		   pipe_mappage(as, chunk->pc_entry, vaddress) == 0){
+			chunk->pc_entry = NULL;
+		}else if(chunk->pc_entry != NULL){
+			if(chunk->pc_off == 0){
+				pipe_unflipped++;
+			}
+			result = pipe_copypage(chunk->pc_entry, chunk->pc_off, (userptr_t)vaddress, n);
+		}else{
+			result = copyout(chunk->pc_buf + chunk->pc_off, (userptr_t)vaddress, n);
+		}
+		if(result){
+			break;
+		}
+
+		chunk->pc_off += n;
+		done += n;
+		if(chunk->pc_off == chunk->pc_len){
+			p->p_head = chunk->pc_next;
+			if(p->p_head == NULL){
+				p->p_tail = NULL;
+			}
+			p->p_nchunks--;
+			if(chunk->pc_entry != NULL){
+				pipe_putpage(chunk->pc_entry);
+			}
+			kfree(chunk->pc_buf);
+			kfree(chunk);
+		}
+	}
+
+	cv_broadcast(p->p_cv, p->p_lock);
+	lock_release(p->p_lock);
+	pipe_put(p);
+
+	*retval = done;
+	return done > 0 ? 0 : result;
+}
+
+/*
+ * Close a pipe. Data still queued is thrown away; blocked writers get
+ * EPIPE and blocked readers see end of file. The pipe itself is freed by
+ * whichever of us lets go of it last.
+ */
+int
+pipe_close(int id){
+	struct pipe * p;
+	struct pipechunk * chunk;
+	int spl;
+
+	if(id < 0 || id >= PIPE_MAX){
+		return EBADF;
+	}
+
+	//take over the reference of the pipes[] slot
+	spl = splhigh();
+	p = pipes[id];
+	pipes[id] = NULL;
+	splx(spl);
+	if(p == NULL){
+		return EBADF;
+	}
+
+	lock_acquire(p->p_lock);
+	p->p_closed = 1;
+	while(p->p_head != NULL){
+		chunk = p->p_head;
+		p->p_head = chunk->pc_next;
+		if(chunk->pc_entry != NULL){
+			pipe_putpage(chunk->pc_entry);
+		}
+		kfree(chunk->pc_buf);
+		kfree(chunk);
+	}
+	p->p_tail = NULL;
+	p->p_nchunks = 0;
+	cv_broadcast(p->p_cv, p->p_lock);
+	lock_release(p->p_lock);
+
+	pipe_put(p);
+	return 0;
+}
+
+/*
+ * System call entry points.
+ */
+int
+sys_pipe(int * retval){
+	return pipe_create(retval);
+}
+
+int
+sys_pipe_write(int id, userptr_t buf, size_t len, int * retval){
+	size_t done;
+	int result = pipe_write(id, buf, len, &done);
+	*retval = done;
+	return result;
+}
+
+int
+sys_pipe_read(int id, userptr_t buf, size_t len, int * retval){
+	size_t done;
+	int result = pipe_read(id, buf, len, &done);
+	*retval = done;
+	return result;
+}
+
+int
+sys_pipe_close(int id){
+	return pipe_close(id);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Benchmark.
+
+#define BENCH_PAGES 16
+#define BENCH_TEXT 0x400000
+#define BENCH_DATA 0x10000000
+
+static struct semaphore * bench_done;
+
+/*
+ * Give a kernel thread a minimal user address space with a heap of
+ * BENCH_PAGES+1 pages, so it can move data through a pipe like a
+ * process would.
+ */
+static
+int
+bench_setup(void){
+	struct addrspace * as;
+
+	as = as_create();
+	if(as == NULL){
+		return ENOMEM;
+	}
+	as_define_region(as, BENCH_TEXT, PAGE_SIZE, 4, 0, 1);
+	as_define_region(as, BENCH_DATA, PAGE_SIZE, 4, 2, 0);
+	as_complete_load(as);
+	as->as_heapEnd = as->as_heapStart + (BENCH_PAGES + 1) * PAGE_SIZE;
+
+	curthread->t_vmspace = as;
+	as_activate(as);
+	return 0;
+}
+
+/*
+ * Writer side: send BENCH_PAGES pages ROUNDS times. The byte offset in
+ * data1's low bit selects an unaligned buffer, which forces the copy path.
+ */
+static
+void
+bench_writer(void * data, unsigned long id){
+	int unaligned = (data != NULL);
+	userptr_t buf;
+	size_t done;
+	char c = 'x';
+	int i;
+
+	if(bench_setup() == 0){
+		buf = (userptr_t)(curthread->t_vmspace->as_heapStart + unaligned);
+		for(i = 0; i < BENCH_PAGES; i++){
+			copyout(&c, buf + i*PAGE_SIZE, 1);
+		}
+		for(i = 0; i < 8; i++){
+			pipe_write(id, buf, BENCH_PAGES*PAGE_SIZE, &done);
+		}
+	}
+	V(bench_done);
+}
+
+static
+void
+bench_reader(void * data, unsigned long id){
+	int unaligned = (data != NULL);
+	userptr_t buf;
+	size_t done, total = 0;
+
+	if(bench_setup() == 0){
+		buf = (userptr_t)(curthread->t_vmspace->as_heapStart + unaligned);
+		while(total < 8*BENCH_PAGES*PAGE_SIZE){
+			if(pipe_read(id, buf + (total % (BENCH_PAGES*PAGE_SIZE)),
+				     BENCH_PAGES*PAGE_SIZE - (total % (BENCH_PAGES*PAGE_SIZE)), &done)
+			   || done == 0){
+				break;
+			}
+			total += done;
+		}
+	}
+	V(bench_done);
+}
+
+static
+int
+bench_run(int unaligned){
+	time_t beforesecs, aftersecs, secs;
+	u_int32_t beforensecs, afternsecs, nsecs;
+	unsigned long flipped = pipe_flipped + pipe_shared;
+	unsigned long copied = pipe_copied;
+	unsigned long unflipped = pipe_unflipped;
+	int id, result;
+
+	result = pipe_create(&id);
+	if(result){
+		return result;
+	}
+
+	gettime(&beforesecs, &beforensecs);
+	result = thread_fork("pipebench writer", unaligned ? (void *)1 : NULL, id, bench_writer, NULL);
+	if(result){
+		pipe_close(id);
+		return result;
+	}
+	result = thread_fork("pipebench reader", unaligned ? (void *)1 : NULL, id, bench_reader, NULL);
+	if(result){
+		//with no reader the writer blocks once the pipe fills; closing
+		//the pipe fails its writes so it can finish
+		pipe_close(id);
+		P(bench_done);
+		return result;
+	}
+	P(bench_done);
+	P(bench_done);
+	gettime(&aftersecs, &afternsecs);
+	pipe_close(id);
+
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs, &secs, &nsecs);
+	kprintf("%s: %d KB in %lu.%09lu seconds (%lu pages flipped, %lu chunks copied, "
+		"%lu flippable pages copied on read)\n",
+		unaligned ? "copy" : "flip", 8*BENCH_PAGES*PAGE_SIZE/1024,
+		(unsigned long) secs, (unsigned long) nsecs,
+		pipe_flipped + pipe_shared - flipped, pipe_copied - copied,
+		pipe_unflipped - unflipped);
+	return 0;
+}
+
+/*
+ * Menu command: compare the page-flipping and copying paths.
+ */
+int
+pipebench(int nargs, char ** args){
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	if(bench_done == NULL){
+		bench_done = sem_create("pipebench", 0);
+		if(bench_done == NULL){
+			return ENOMEM;
+		}
+	}
+
+	result = bench_run(0);
+	if(result == 0){
+		result = bench_run(1);
+	}
+	kprintf("pipe totals: %lu flipped, %lu shared, %lu copied, %lu copied on read\n",
+		pipe_flipped, pipe_shared, pipe_copied, pipe_unflipped);
+	return result;
+}
@@ -0,0 +1,182 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/limits.h>
+#include <lib.h>
+#include <thread.h>
+#include <curthread.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/vm.h>
+
+/*
+ * Named shared memory segments.
+ *
+ * A segment is an anonymous vmobject with a name. Attaching maps the
+ * object into the caller as a shared mapping, so producers and consumers
+ * touch the very same frames and nothing is copied. Segments are marked
+ * VO_EVICTUNIT: under memory pressure the whole segment goes to swap at
+ * once and comes back a page at a time as it is touched.
+ *
+ * The segment list holds one reference on each object for the name;
+ * every attachment holds another. A segment lives until it has been
+ * unlinked and the last attachment is gone.
+ *
+ * Protected by page_lock, like the rest of the VM.
+ */
+
+struct shmseg {
+	char * name;
+	struct vmobject * obj;
+	size_t npages;
+	struct shmseg * next;
+};
+
+static struct shmseg * shmsegs;
+
+static
+struct shmseg *
+shm_find(const char * name){
+	struct shmseg * seg;
+
+	for(seg = shmsegs; seg != NULL; seg = seg->next){
+		if(!strcmp(seg->name, name)){
+			return seg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * shm_create() system call. Creates segment NAME of SIZE bytes.
+ */
+int
+sys_shm_create(userptr_t uname, size_t size){
+	char name[NAME_MAX+1];
+	struct shmseg * seg;
+	int result;
+
+	if(size == 0){
+		return EINVAL;
+	}
+	result = copyinstr(uname, name, sizeof(name), NULL);
+	if(result){
+		return result;
+	}
+
+	seg = kmalloc(sizeof(struct shmseg));
+	if(seg == NULL){
+		return ENOMEM;
+	}
+	seg->name = kstrdup(name);
+	if(seg->name == NULL){
+		kfree(seg);
+		return ENOMEM;
+	}
+	seg->npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	lock_acquire(page_lock);
+	if(shm_find(name) != NULL){
+		lock_release(page_lock);
+		kfree(seg->name);
+		kfree(seg);
+		return EEXIST;
+	}
+
+	seg->obj = vmobject_create(NULL, seg->npages);
+	if(seg->obj == NULL){
+		lock_release(page_lock);
+		kfree(seg->name);
+		kfree(seg);
+		return ENOMEM;
+	}
+	seg->obj->vo_flags |= VO_EVICTUNIT;
+
+	seg->next = shmsegs;
+	shmsegs = seg;
+	lock_release(page_lock);
+	return 0;
+}
+
+/*
+ * shm_attach() system call. Maps segment NAME into the caller with
+ * protection PROT and returns its address.
+ */
+int
+sys_shm_attach(userptr_t uname, int prot, vaddr_t * retval){
+	struct addrspace * as = curthread->t_vmspace;
+	char name[NAME_MAX+1];
+	struct shmseg * seg;
+	int result;
+
+	if(as == NULL){
+		return EFAULT;
+	}
+	if((prot & ~(PROT_READ|PROT_WRITE)) != 0){
+		return EINVAL;
+	}
+	result = copyinstr(uname, name, sizeof(name), NULL);
+	if(result){
+		return result;
+	}
+
+	lock_acquire(page_lock);
+	seg = shm_find(name);
+	if(seg == NULL){
+		lock_release(page_lock);
+		return ENOENT;
+	}
+
+	seg->obj->vo_refcount++;
+	result = mmap_addregion(as, seg->obj, seg->npages, prot, MAP_SHARED, 0, retval);
+	if(result){
+		seg->obj->vo_refcount--;
+	}
+	lock_release(page_lock);
+	return result;
+}
+
+/*
+ * shm_detach() system call. Unmaps the segment attached at ADDR.
+ */
+int
+sys_shm_detach(userptr_t addr){
+	struct addrspace * as = curthread->t_vmspace;
+
+	if(as == NULL){
+		return EFAULT;
+	}
+	return mmap_removeregion(as, (vaddr_t)addr, 0);
+}
+
+/*
+ * shm_unlink() system call. Removes the name; the memory goes away once
+ * the last attachment is detached.
+ */
+int
+sys_shm_unlink(userptr_t uname){
+	char name[NAME_MAX+1];
+	struct shmseg ** prev;
+	struct shmseg * seg;
+	int result;
+
+	result = copyinstr(uname, name, sizeof(name), NULL);
+	if(result){
+		return result;
+	}
+
+	lock_acquire(page_lock);
+	for(prev = &shmsegs; *prev != NULL; prev = &(*prev)->next){
+		seg = *prev;
+		if(!strcmp(seg->name, name)){
+			*prev = seg->next;
+			vmobject_release(seg->obj);
+			lock_release(page_lock);
+			kfree(seg->name);
+			kfree(seg);
+			return 0;
+		}
+	}
+	lock_release(page_lock);
+	return ENOENT;
+}
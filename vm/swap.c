@@ -0,0 +1,614 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/unistd.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <thread.h>
+#include <vm.h>
+#include <machine/spl.h>
+#include <machine/vm.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+
+/*
+ * Swap devices.
+ *
+ * Swap can be spread over several raw disks (lhd0raw:, lhd1raw:, ...).
+ * A swap slot is a single int, as stored in ptentry->location and the
+ * vmobject slot arrays, that encodes both the device and the page on it:
+ *
+ *	slot = page * SWAP_MAXDEV + device
+ *
+ * Slot 0 means "no slot", so page 0 of device 0 is never handed out.
+ *
+ * New slots go to the devices in turn (SWAP_ROUNDROBIN), so consecutive
+ * pageouts land on different disks, or to whichever device has the
+ * fewest requests in flight (SWAP_QDEPTH).
+ *
+ * Each device has a request queue and a worker thread. Callers submit a
+ * page read or write and either sleep until it completes (swap_read,
+ * swap_write) or get a callback from the worker (swap_writeasync). The
+ * worker services the queue in C-LOOK order: the nearest request at or
+ * past the last page it touched, wrapping to the lowest page when there
+ * is nothing further along. Requests for the next pages on the disk in
+ * the same direction are merged into one transfer of up to
+ * SWAP_MERGEMAX pages through a bounce buffer.
+ *
+ * A read of a page that still has a write queued or in progress is
+ * served from the write's buffer, and a new write to a page replaces a
+ * queued one, so the queue never reorders two operations on one slot.
+ */
+
+#define SWAP_MERGEMAX 8
+
+struct swapreq {
+	int sr_page;			/* page on the device */
+	void * sr_buf;
+	enum uio_rw sr_rw;
+	int sr_done;
+	int sr_result;
+	void (*sr_callback)(int, int);	/* async only: (frame, result) */
+	int sr_index;			/* async only: frame being written */
+	struct swapreq * sr_next;
+};
+
+struct swapdev {
+	char * sd_name;
+	struct vnode * sd_vnode;
+	int sd_npages;
+	int sd_used;			/* slots allocated */
+	int sd_hint;			/* where to start looking for a free page */
+	char * sd_map;			/* 1 if page is allocated */
+
+	struct swapreq * sd_queue;	/* waiting, in submission order */
+	struct swapreq * sd_active;	/* being transferred by the worker */
+	int sd_headpos;			/* page after the last one transferred */
+	char * sd_bounce;		/* SWAP_MERGEMAX pages for merged I/O */
+
+	int sd_inflight;		/* requests queued or being serviced */
+	int sd_maxdepth;
+	unsigned long sd_reads;
+	unsigned long sd_writes;
+	unsigned long sd_errors;
+	unsigned long sd_transfers;	/* VOP calls, after merging */
+	unsigned long sd_merged;	/* requests folded into another's transfer */
+	unsigned long sd_forwarded;	/* reads served from a pending write */
+	unsigned long sd_superseded;	/* queued writes replaced by a newer one */
+	time_t sd_busysecs;		/* total time spent in I/O */
+	u_int32_t sd_busynsecs;
+};
+
+static struct swapdev swapdevs[SWAP_MAXDEV];
+static int nswapdevs;
+static int swap_policy = SWAP_ROUNDROBIN;
+static int swap_next;			/* round-robin cursor */
+
+static void swap_worker(void * data, unsigned long dev);
+
+/*
+ * Open PATH and add it as a swap device. Returns an error if it cannot
+ * be opened or we already have SWAP_MAXDEV devices.
+ */
+int
+swap_adddev(const char * path){
+	struct swapdev * sd;
+	struct vnode * v;
+	struct stat st;
+	char * name;
+	int result, i;
+
+	if(nswapdevs >= SWAP_MAXDEV){
+		return ENOSPC;
+	}
+
+	name = kstrdup(path);
+	if(name == NULL){
+		return ENOMEM;
+	}
+
+	//vfs_open may modify its argument
+	result = vfs_open(name, O_RDWR, &v);
+	if(result){
+		kfree(name);
+		return result;
+	}
+	strcpy(name, path);
+
+	result = VOP_STAT(v, &st);
+	if(result){
+		vfs_close(v);
+		kfree(name);
+		return result;
+	}
+
+	sd = &swapdevs[nswapdevs];
+	sd->sd_npages = st.st_size / PAGE_SIZE;
+	if(sd->sd_npages < 1){
+		vfs_close(v);
+		kfree(name);
+		return EINVAL;
+	}
+	sd->sd_map = kmalloc(sd->sd_npages);
+	sd->sd_bounce = kmalloc(SWAP_MERGEMAX * PAGE_SIZE);
+	if(sd->sd_map == NULL || sd->sd_bounce == NULL){
+		kfree(sd->sd_map);
+		kfree(sd->sd_bounce);
+		vfs_close(v);
+		kfree(name);
+		return ENOMEM;
+	}
+	for(i = 0; i < sd->sd_npages; i++){
+		sd->sd_map[i] = 0;
+	}
+
+	sd->sd_name = name;
+	sd->sd_vnode = v;
+	sd->sd_used = 0;
+	sd->sd_hint = 0;
+	sd->sd_queue = NULL;
+	sd->sd_active = NULL;
+	sd->sd_headpos = 0;
+	sd->sd_inflight = 0;
+	sd->sd_maxdepth = 0;
+	sd->sd_reads = 0;
+	sd->sd_writes = 0;
+	sd->sd_errors = 0;
+	sd->sd_transfers = 0;
+	sd->sd_merged = 0;
+	sd->sd_forwarded = 0;
+	sd->sd_superseded = 0;
+	sd->sd_busysecs = 0;
+	sd->sd_busynsecs = 0;
+
+	//slot 0 means "no slot"
+	if(nswapdevs == 0){
+		sd->sd_map[0] = 1;
+		sd->sd_used = 1;
+	}
+
+	result = thread_fork(name, NULL, nswapdevs, swap_worker, NULL);
+	if(result){
+		kfree(sd->sd_map);
+		kfree(sd->sd_bounce);
+		vfs_close(v);
+		kfree(name);
+		return result;
+	}
+
+	//only publish the device once it is completely set up
+	int spl = splhigh();
+	nswapdevs++;
+	splx(spl);
+
+	kprintf("swap: %s, %d pages\n", path, sd->sd_npages);
+	return 0;
+}
+
+int
+swap_ndevs(void){
+	return nswapdevs;
+}
+
+void
+swap_setpolicy(int policy){
+	assert(policy == SWAP_ROUNDROBIN || policy == SWAP_QDEPTH);
+	swap_policy = policy;
+}
+
+/*
+ * Take a free page on device DEV. Returns the slot, or 0 if it is full.
+ * Called at splhigh.
+ */
+static
+int
+swap_allocdev(int dev){
+	struct swapdev * sd = &swapdevs[dev];
+	int i, page;
+
+	if(sd->sd_used >= sd->sd_npages){
+		return 0;
+	}
+
+	for(i = 0; i < sd->sd_npages; i++){
+		page = (sd->sd_hint + i) % sd->sd_npages;
+		if(sd->sd_map[page] == 0){
+			sd->sd_map[page] = 1;
+			sd->sd_used++;
+			sd->sd_hint = page + 1;
+			return page * SWAP_MAXDEV + dev;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Allocate a swap slot. Returns 0 if every device is full.
+ */
+int
+swap_alloc(void){
+	int i, dev, best, slot = 0;
+
+	int spl = splhigh();
+
+	if(swap_policy == SWAP_QDEPTH){
+		//shortest queue first, round-robin among equals
+		best = -1;
+		for(i = 0; i < nswapdevs; i++){
+			dev = (swap_next + i) % nswapdevs;
+			if(swapdevs[dev].sd_used >= swapdevs[dev].sd_npages){
+				continue;
+			}
+			if(best < 0 || swapdevs[dev].sd_inflight < swapdevs[best].sd_inflight){
+				best = dev;
+			}
+		}
+		if(best >= 0){
+			slot = swap_allocdev(best);
+			swap_next = (best + 1) % nswapdevs;
+		}
+	}else{
+		for(i = 0; i < nswapdevs && slot == 0; i++){
+			dev = swap_next;
+			swap_next = (swap_next + 1) % nswapdevs;
+			slot = swap_allocdev(dev);
+		}
+	}
+
+	splx(spl);
+	return slot;
+}
+
+void
+swap_free(int slot){
+	struct swapdev * sd;
+	int page;
+
+	assert(slot > 0);
+	sd = &swapdevs[slot % SWAP_MAXDEV];
+	page = slot / SWAP_MAXDEV;
+
+	int spl = splhigh();
+	assert(page < sd->sd_npages && sd->sd_map[page] == 1);
+	sd->sd_map[page] = 0;
+	sd->sd_used--;
+	splx(spl);
+}
+
+int
+swap_inuse(int slot){
+	struct swapdev * sd;
+	int page;
+
+	if(slot <= 0 || slot % SWAP_MAXDEV >= nswapdevs){
+		return 0;
+	}
+	sd = &swapdevs[slot % SWAP_MAXDEV];
+	page = slot / SWAP_MAXDEV;
+	return page < sd->sd_npages && sd->sd_map[page] == 1;
+}
+
+/*
+ * Take the next request off SD's queue in C-LOOK order, plus any queued
+ * requests for the pages right after it in the same direction, and link
+ * them onto sd_active. Returns the number of pages. Called at splhigh
+ * with a non-empty queue.
+ */
+static
+int
+swap_pickrun(struct swapdev * sd){
+	struct swapreq ** prev;
+	struct swapreq ** best;
+	struct swapreq ** lowest;
+	struct swapreq * req;
+	struct swapreq * tail;
+	int n, found;
+
+	best = NULL;
+	lowest = NULL;
+	for(prev = &sd->sd_queue; *prev != NULL; prev = &(*prev)->sr_next){
+		req = *prev;
+		if(req->sr_page >= sd->sd_headpos &&
+		   (best == NULL || req->sr_page < (*best)->sr_page)){
+			best = prev;
+		}
+		if(lowest == NULL || req->sr_page < (*lowest)->sr_page){
+			lowest = prev;
+		}
+	}
+	if(best == NULL){
+		best = lowest;
+	}
+
+	req = *best;
+	*best = req->sr_next;
+	req->sr_next = NULL;
+	sd->sd_active = req;
+	tail = req;
+
+	for(n = 1; n < SWAP_MERGEMAX; n++){
+		found = 0;
+		for(prev = &sd->sd_queue; *prev != NULL; prev = &(*prev)->sr_next){
+			req = *prev;
+			if(req->sr_page == tail->sr_page + 1 && req->sr_rw == tail->sr_rw){
+				*prev = req->sr_next;
+				req->sr_next = NULL;
+				tail->sr_next = req;
+				tail = req;
+				found = 1;
+				break;
+			}
+		}
+		if(!found){
+			break;
+		}
+	}
+
+	sd->sd_merged += n - 1;
+	return n;
+}
+
+/*
+ * Mark REQ finished and let whoever is waiting on it know. Called at
+ * splhigh.
+ */
+static
+void
+swap_complete(struct swapdev * sd, struct swapreq * req, int result){
+	sd->sd_inflight--;
+	req->sr_result = result;
+	req->sr_done = 1;
+	if(req->sr_callback != NULL){
+		req->sr_callback(req->sr_index, result);
+		kfree(req);
+	}else{
+		thread_wakeup(req);
+	}
+}
+
+/*
+ * Per-device worker. Sleeps until something is queued, then transfers
+ * one run of adjacent pages at a time.
+ */
+static
+void
+swap_worker(void * data, unsigned long dev){
+	struct swapdev * sd = &swapdevs[dev];
+	struct swapreq * req;
+	struct swapreq * next;
+	struct uio tempuio;
+	time_t s1, s2, rs;
+	u_int32_t ns1, ns2, rns;
+	int n, i, result, spl;
+	void * buf;
+
+	(void)data;
+
+	while(1){
+		spl = splhigh();
+		while(sd->sd_queue == NULL){
+			thread_sleep(sd);
+		}
+		n = swap_pickrun(sd);
+		splx(spl);
+
+		req = sd->sd_active;
+		buf = req->sr_buf;
+		if(n > 1){
+			buf = sd->sd_bounce;
+			if(req->sr_rw == UIO_WRITE){
+				for(i = 0, next = req; next != NULL; i++, next = next->sr_next){
+					memcpy(sd->sd_bounce + i*PAGE_SIZE, next->sr_buf, PAGE_SIZE);
+				}
+			}
+		}
+
+		gettime(&s1, &ns1);
+		mk_kuio(&tempuio, buf, n * PAGE_SIZE, (off_t)req->sr_page * PAGE_SIZE, req->sr_rw);
+		if(req->sr_rw == UIO_READ){
+			result = VOP_READ(sd->sd_vnode, &tempuio);
+		}else{
+			result = VOP_WRITE(sd->sd_vnode, &tempuio);
+		}
+		gettime(&s2, &ns2);
+		getinterval(s1, ns1, s2, ns2, &rs, &rns);
+
+		if(n > 1 && req->sr_rw == UIO_READ && result == 0){
+			for(i = 0, next = req; next != NULL; i++, next = next->sr_next){
+				memcpy(next->sr_buf, sd->sd_bounce + i*PAGE_SIZE, PAGE_SIZE);
+			}
+		}
+
+		spl = splhigh();
+		sd->sd_transfers++;
+		sd->sd_headpos = req->sr_page + n;
+		sd->sd_busysecs += rs;
+		sd->sd_busynsecs += rns;
+		if(sd->sd_busynsecs >= 1000000000){
+			sd->sd_busynsecs -= 1000000000;
+			sd->sd_busysecs++;
+		}
+		sd->sd_active = NULL;
+		if(req->sr_rw == UIO_READ){
+			sd->sd_reads += n;
+		}else{
+			sd->sd_writes += n;
+		}
+		if(result){
+			sd->sd_errors++;
+		}
+		while(req != NULL){
+			next = req->sr_next;
+			swap_complete(sd, req, result);
+			req = next;
+		}
+		splx(spl);
+	}
+}
+
+/*
+ * Queue REQ on the device holding SLOT. Returns 1 if the request could
+ * be completed on the spot from a pending write.
+ */
+static
+int
+swap_submit(int slot, struct swapreq * req){
+	struct swapdev * sd;
+	struct swapreq ** prev;
+	struct swapreq * other;
+	struct swapreq * pending = NULL;
+
+	assert(slot > 0 && slot % SWAP_MAXDEV < nswapdevs);
+	sd = &swapdevs[slot % SWAP_MAXDEV];
+	req->sr_page = slot / SWAP_MAXDEV;
+	req->sr_done = 0;
+	req->sr_result = 0;
+	req->sr_next = NULL;
+
+	int spl = splhigh();
+
+	//the newest write to this page is the queued one, if any
+	for(other = sd->sd_active; other != NULL; other = other->sr_next){
+		if(other->sr_page == req->sr_page && other->sr_rw == UIO_WRITE){
+			pending = other;
+		}
+	}
+	for(other = sd->sd_queue; other != NULL; other = other->sr_next){
+		if(other->sr_page == req->sr_page && other->sr_rw == UIO_WRITE){
+			pending = other;
+		}
+	}
+
+	if(req->sr_rw == UIO_READ && pending != NULL){
+		memcpy(req->sr_buf, pending->sr_buf, PAGE_SIZE);
+		req->sr_done = 1;
+		sd->sd_forwarded++;
+		splx(spl);
+		return 1;
+	}
+
+	if(req->sr_rw == UIO_WRITE){
+		for(prev = &sd->sd_queue; *prev != NULL; prev = &(*prev)->sr_next){
+			other = *prev;
+			if(other->sr_page == req->sr_page){
+				//only writes can be queued against a page here
+				assert(other->sr_rw == UIO_WRITE);
+				*prev = other->sr_next;
+				sd->sd_superseded++;
+				swap_complete(sd, other, 0);
+				break;
+			}
+		}
+	}
+
+	req->sr_next = sd->sd_queue;
+	sd->sd_queue = req;
+	sd->sd_inflight++;
+	if(sd->sd_inflight > sd->sd_maxdepth){
+		sd->sd_maxdepth = sd->sd_inflight;
+	}
+	thread_wakeup(sd);
+
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Move one page between kernel address BUF and swap slot SLOT and wait
+ * for it to finish.
+ */
+static
+int
+swap_io(int slot, void * buf, enum uio_rw rw){
+	struct swapreq req;
+
+	req.sr_buf = buf;
+	req.sr_rw = rw;
+	req.sr_callback = NULL;
+	req.sr_index = 0;
+
+	if(swap_submit(slot, &req)){
+		return 0;
+	}
+
+	int spl = splhigh();
+	while(!req.sr_done){
+		thread_sleep(&req);
+	}
+	splx(spl);
+
+	return req.sr_result;
+}
+
+/*
+ * Read swap slot SLOT into coremap frame INDEX.
+ */
+int
+swap_read(int slot, int index){
+	return swap_io(slot, (void *)PADDR_TO_KVADDR(index*PAGE_SIZE), UIO_READ);
+}
+
+/*
+ * Write coremap frame INDEX out to swap slot SLOT.
+ */
+int
+swap_write(int slot, int index){
+	return swap_io(slot, (void *)PADDR_TO_KVADDR(index*PAGE_SIZE), UIO_WRITE);
+}
+
+/*
+ * Start writing coremap frame INDEX to swap slot SLOT and return at
+ * once. CALLBACK(index, result) runs in the worker thread, at splhigh,
+ * when the write is done; until then the frame must not be reused.
+ */
+int
+swap_writeasync(int slot, int index, void (*callback)(int, int)){
+	struct swapreq * req;
+
+	req = kmalloc(sizeof(struct swapreq));
+	if(req == NULL){
+		return ENOMEM;
+	}
+	req->sr_buf = (void *)PADDR_TO_KVADDR(index*PAGE_SIZE);
+	req->sr_rw = UIO_WRITE;
+	req->sr_callback = callback;
+	req->sr_index = index;
+
+	swap_submit(slot, req);
+	return 0;
+}
+
+/*
+ * Read swap slot SLOT into an arbitrary kernel buffer.
+ */
+int
+swap_readbuf(int slot, void * buf){
+	return swap_io(slot, buf, UIO_READ);
+}
+
+void
+swap_printstats(void){
+	struct swapdev * sd;
+	unsigned long ms, kbps;
+	int i;
+
+	kprintf("swap: %d device(s), %s allocation\n", nswapdevs,
+		swap_policy == SWAP_QDEPTH ? "queue depth" : "round-robin");
+	for(i = 0; i < nswapdevs; i++){
+		sd = &swapdevs[i];
+		ms = sd->sd_busysecs * 1000 + sd->sd_busynsecs / 1000000;
+		kbps = 0;
+		if(ms > 0){
+			kbps = (sd->sd_reads + sd->sd_writes) * (PAGE_SIZE/1024) * 1000 / ms;
+		}
+		kprintf("  %s: %d/%d pages used\n", sd->sd_name, sd->sd_used, sd->sd_npages);
+		kprintf("    reads %lu, writes %lu, errors %lu\n",
+			sd->sd_reads, sd->sd_writes, sd->sd_errors);
+		kprintf("    busy %lu ms, %lu KB/s, queue depth %d (max %d)\n",
+			ms, kbps, sd->sd_inflight, sd->sd_maxdepth);
+		kprintf("    transfers %lu, merged %lu, forwarded %lu, superseded %lu\n",
+			sd->sd_transfers, sd->sd_merged, sd->sd_forwarded,
+			sd->sd_superseded);
+	}
+}
@@ -3,6 +3,7 @@
 #include <lib.h>
 #include <thread.h>
 #include <curthread.h>
+#include <synch.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <machine/spl.h>
@@ -27,6 +28,86 @@
 
 int isBooted = 0; 
 
+/*
+ * Paging hints set through madvise(). Each address space keeps a list of
+ * ranges of its heap/stack that were marked sequential or random.
+ */
+struct advrange {
+	vaddr_t start;
+	vaddr_t end;
+	int advice;
+	struct advrange * next;
+};
+
+/* number of pages read ahead / dropped behind on a sequential fault */
+#define MADV_READAHEAD 4
+
+/*
+ * Queue of pages waiting to be brought back in from swap by the prefetch
+ * thread. Protected by splhigh; a full queue just drops the request, since
+ * a missed prefetch only costs us the fault we would have taken anyway.
+ */
+#define PREFETCH_MAX 64
+
+static struct {
+	struct addrspace * as;
+	vaddr_t vaddress;
+} prefetch_queue[PREFETCH_MAX];
+
+static int prefetch_head;
+static int prefetch_tail;
+static struct semaphore * prefetch_sem;
+
+static void prefetch_thread(void * unused, unsigned long junk);
+
+/*
+ * Emergency reserve of frames for kernel allocations. alloc_kpages runs at
+ * splhigh, so when no frame is free it takes one of these rather than
+ * swapping a page out itself, and wakes the pageout thread to top the
+ * reserve back up from thread context. Reserved frames are marked TRASH
+ * so the user fault path and findoldestpage leave them alone.
+ */
+#define KRESERVE_TARGET 8
+
+static int kreserve[KRESERVE_TARGET];
+static int kreserve_count;
+
+/* statistics */
+static unsigned long kreserve_taken;
+static unsigned long kreserve_exhausted;
+static unsigned long kreserve_refilled;
+static unsigned long kreserve_swapouts;
+
+/* evictions the pageout thread has started but the disk has not finished */
+#define PAGEOUT_MAXINFLIGHT 4
+static int pageout_inflight;
+static unsigned long pageout_async;
+
+static void pageout_thread(void * unused, unsigned long junk);
+static int kreserve_take(void);
+
+/* fault path statistics; latencies are sampled every FAULT_SAMPLE faults */
+#define FAULT_SAMPLE 64
+
+static unsigned long fault_count;
+static unsigned long refill_fast;
+static unsigned long refill_slow;
+static unsigned long refill_busy;	/* fast path gave way to page_lock */
+static unsigned long refill_fastsamples;
+static unsigned long refill_slowsamples;
+static time_t refill_fastsecs;
+static u_int32_t refill_fastnsecs;
+static time_t refill_slowsecs;
+static u_int32_t refill_slownsecs;
+
+/* compaction statistics */
+static unsigned long compact_runs;
+static unsigned long compact_success;
+static unsigned long compact_fail;
+static unsigned long compact_busy;	/* page_lock already held */
+static unsigned long compact_migrated;
+static unsigned long compact_scanned;
+
 int
 load_segment(struct vnode *v, off_t offset, vaddr_t vaddr, 
     size_t memsize, size_t filesize,
@@ -109,6 +190,8 @@ vm_bootstrap(void)
 		coremap[i] = (struct coremapblock *)PADDR_TO_KVADDR(first_paddr + sizeof(coremap) + i * sizeof(struct coremapblock));
 		coremap[i]->as = NULL;
 		coremap[i]->vaddress = 0;
+		coremap[i]->npages = 0;
+		coremap[i]->obj = NULL;
 		
 		if(i < num_trash){
 			coremap[i]->status = TRASH;
@@ -118,12 +201,192 @@ vm_bootstrap(void)
 	}
 
 	isBooted = 1;
-	firstbigswap = 0;
-	for(i = 0; i < 1280; i++){
-		offsetavailable[i] = 0;
+
+	prefetch_sem = sem_create("prefetch sem", 0);
+	prefetch_head = 0;
+	prefetch_tail = 0;
+
+	//fill the kernel reserve straight off the free list
+	kreserve_count = 0;
+	while(kreserve_count < KRESERVE_TARGET){
+		int index = findavailablepage();
+		if(index == 0){
+			break;
+		}
+		coremap[index]->status = TRASH;
+		kreserve[kreserve_count++] = index;
+	}
+}
+
+/*
+ * Start the VM helper threads. Called from boot() once the swap device
+ * is open, since the helpers issue swap I/O.
+ */
+void
+vm_startdaemons(void)
+{
+	int result;
+
+	result = thread_fork("vm prefetch", NULL, 0, prefetch_thread, NULL);
+	if(result){
+		panic("vm: could not start prefetch thread: %s\n", strerror(result));
+	}
+
+	result = thread_fork("vm pageout", NULL, 0, pageout_thread, NULL);
+	if(result){
+		panic("vm: could not start pageout thread: %s\n", strerror(result));
+	}
+
+	as_startreaper();
+}
+
+/*
+ * Hand out a frame from the kernel reserve, or 0 if it is empty. Must be
+ * called at splhigh. Always pokes the pageout thread, since either the
+ * reserve just shrank or it was already empty.
+ */
+static
+int
+kreserve_take(void){
+	int index = 0;
+
+	assert(curspl>0);
+
+	if(kreserve_count > 0){
+		index = kreserve[--kreserve_count];
+		kreserve_taken++;
+	}
+	thread_wakeup(&kreserve_count);
+	return index;
+}
+
+/*
+ * Called from the swap worker, at splhigh, when a write started by the
+ * pageout thread finishes. The frame goes straight into the reserve if
+ * it is short, otherwise back on the free list.
+ */
+static
+void
+pageout_done(int index, int result){
+	if(result){
+		kprintf("vm pageout: swap write failed Error: %d\n", result);
+	}
+
+	coremap[index]->as = NULL;
+	coremap[index]->vaddress = 0;
+	if(kreserve_count < KRESERVE_TARGET){
+		coremap[index]->status = TRASH;
+		kreserve[kreserve_count++] = index;
+		kreserve_refilled++;
+	}else{
+		coremap[index]->status = FREE;
+	}
+
+	pageout_inflight--;
+	thread_wakeup(&kreserve_count);
+}
+
+/*
+ * Pageout thread. Sleeps until the reserve drops below its target, then
+ * refills it from the free list, swapping out the oldest user pages when
+ * there is nothing free. This is the only place the reserve is refilled
+ * with disk I/O, and it runs with interrupts on.
+ *
+ * User pages are written out asynchronously, up to PAGEOUT_MAXINFLIGHT
+ * at a time, and page_lock is dropped as soon as each write is queued,
+ * so faulting processes keep running while the disk catches up.
+ */
+static
+void
+pageout_thread(void * unused, unsigned long junk){
+	int index, spl;
+
+	(void)unused;
+	(void)junk;
+
+	while(1){
+		spl = splhigh();
+		while(kreserve_count + pageout_inflight >= KRESERVE_TARGET ||
+		      pageout_inflight >= PAGEOUT_MAXINFLIGHT){
+			thread_sleep(&kreserve_count);
+		}
+		splx(spl);
+
+		index = findavailablepage();
+		if(index == 0){
+			lock_acquire(page_lock);
+			index = findoldestpage();
+			if(index < 0){
+				//only kernel, pinned or in-transit frames; nothing to evict
+				lock_release(page_lock);
+				clocksleep(1);
+				continue;
+			}
+
+			spl = splhigh();
+			pageout_inflight++;
+			splx(spl);
+			if(swapout_begin(index, pageout_done) == 0){
+				lock_release(page_lock);
+				kreserve_swapouts++;
+				pageout_async++;
+				continue;
+			}
+			spl = splhigh();
+			pageout_inflight--;
+			splx(spl);
+
+			swapout_droplock(index);
+			lock_release(page_lock);
+			kreserve_swapouts++;
+		}
+
+		//a fault may have grabbed the frame while we were swapping
+		spl = splhigh();
+		if(coremap[index]->status == FREE && kreserve_count < KRESERVE_TARGET){
+			coremap[index]->status = TRASH;
+			coremap[index]->as = NULL;
+			coremap[index]->vaddress = 0;
+			kreserve[kreserve_count++] = index;
+			kreserve_refilled++;
+		}
+		splx(spl);
 	}
 }
 
+/*
+ * Dump VM statistics.
+ */
+void
+vm_printstats(void){
+	kprintf("kernel frame reserve: %d/%d\n", kreserve_count, KRESERVE_TARGET);
+	kprintf("  frames taken:      %lu\n", kreserve_taken);
+	kprintf("  frames refilled:   %lu\n", kreserve_refilled);
+	kprintf("  pageout swapouts:  %lu (%lu async, %d in flight)\n",
+		kreserve_swapouts, pageout_async, pageout_inflight);
+	kprintf("  reserve exhausted: %lu\n", kreserve_exhausted);
+	kprintf("faults: %lu fast refills, %lu slow path (%lu with page_lock busy)\n",
+		refill_fast, refill_slow, refill_busy);
+	if(refill_fastsamples > 0){
+		kprintf("  fast path:         %lu ns average\n",
+			(unsigned long)((refill_fastsecs * 1000000000ULL + refill_fastnsecs)
+					/ refill_fastsamples));
+	}
+	if(refill_slowsamples > 0){
+		kprintf("  slow path:         %lu ns average\n",
+			(unsigned long)((refill_slowsecs * 1000000000ULL + refill_slownsecs)
+					/ refill_slowsamples));
+	}
+	kprintf("compaction: %lu runs, %lu succeeded, %lu failed, %lu skipped (page_lock busy)\n",
+		compact_runs, compact_success, compact_fail, compact_busy);
+	kprintf("  frames scanned:    %lu\n", compact_scanned);
+	kprintf("  pages migrated:    %lu\n", compact_migrated);
+	as_printstats();
+	tlb_printstats();
+	exectrace_printstats();
+	swap_printstats();
+}
+
 vaddr_t 
 alloc_kpages(int numpages)
 {	
@@ -134,25 +397,59 @@ alloc_kpages(int numpages)
 		if(paddress == 0){
 			return 0;
 		}		
+	}else if(numpages > 1){
+		int i, spl = splhigh();
+
+		//multi-page allocations need a physically contiguous run
+		int index = findavailablerun(numpages);
+		if(index == 0){
+			index = vm_compact(numpages);
+		}
+		if(index == 0){
+			splx(spl);
+			return 0;
+		}
+
+		for(i = index; i < index + numpages; i++){
+			coremap[i]->status = TRASH;
+			coremap[i]->as = NULL;
+			coremap[i]->vaddress = 0;
+			coremap[i]->npages = 0;
+		}
+		coremap[index]->npages = numpages;
+
+		paddress = index * PAGE_SIZE;
+		bzero((void*)PADDR_TO_KVADDR(paddress), numpages*PAGE_SIZE);
+		splx(spl);
 	}else{
 		int spl = splhigh();	
 
 		int index = findavailablepage();
 
 		if(index == 0){
-			index = findoldestpage();
-			swapout(index);
+			//no free frame: dip into the reserve and let the pageout
+			//thread do the swapping instead of writing to disk here
+			index = kreserve_take();
+			if(index == 0){
+				//reserve is dry too: fail rather than swap at
+				//splhigh; the pageout thread is already awake
+				kreserve_exhausted++;
+				splx(spl);
+				return 0;
+			}
 		}		
 		lock_acquire(core_lock);
 		
 		coremap[index]->status = TRASH;
 		coremap[index]->as = NULL;		
 		coremap[index]->vaddress = 0;
+		coremap[index]->npages = 1;
 
 		paddress = index * PAGE_SIZE;
 		lock_release(core_lock);
 
 		if (paddress == 0) {
+		    splx(spl);
 		    return 0;
 		}
 		bzero((void*)PADDR_TO_KVADDR(index*PAGE_SIZE), PAGE_SIZE);	
@@ -167,20 +464,87 @@ free_kpages(vaddr_t addr)
 	paddr_t paddress = KVADDR_TO_PADDR(addr);	
 
 	int index = paddress/PAGE_SIZE;
+	int i, npages;
 	int spl = splhigh();
 
-	coremap[index]->status = FREE;
-	coremap[index]->as = NULL;
-	coremap[index]->vaddress = 0;
-	coremap[index]->secs = 0;
-	coremap[index]->nsecs = 0;
+	npages = coremap[index]->npages;
+	if(npages < 1){
+		npages = 1;
+	}
 
+	for(i = index; i < index + npages; i++){
+		coremap[i]->status = FREE;
+		coremap[i]->as = NULL;
+		coremap[i]->vaddress = 0;
+		coremap[i]->secs = 0;
+		coremap[i]->nsecs = 0;
+		coremap[i]->npages = 0;
+	}
 
 	splx(spl);
 }
 
+/*
+ * Get a free frame for the fault path, swapping out the oldest page if
+ * there is none. swapout lets go of page_lock while it writes, after
+ * which the page table may have changed under the fault; in that case
+ * the frame is set aside in *SPARE (TRASH, so nobody else takes it) and
+ * -1 is returned, and the fault starts over and gets the frame on its
+ * next call. Returns 0 if there is nothing left to evict.
+ */
 int
-vm_fault(int faulttype, vaddr_t faultaddress)
+fault_getframe(int * spare){
+	int index, spl;
+
+	if(*spare != 0){
+		index = *spare;
+		*spare = 0;
+		return index;
+	}
+
+	index = findavailablepage();
+	if(index != 0){
+		return index;
+	}
+	index = findoldestpage();
+	if(index < 0){
+		return 0;
+	}
+	swapout_droplock(index);
+
+	spl = splhigh();
+	coremap[index]->status = TRASH;
+	splx(spl);
+	*spare = index;
+	return -1;
+}
+
+/*
+ * Give back a frame fault_getframe set aside that the fault did not end
+ * up needing.
+ */
+void
+fault_putframe(int * spare){
+	int spl;
+
+	if(*spare != 0){
+		spl = splhigh();
+		coremap[*spare]->status = FREE;
+		splx(spl);
+		*spare = 0;
+	}
+}
+
+/*
+ * Full fault handler: region and permission checks, page_lock, swap,
+ * copy-on-write and demand loading. vm_fault only comes here when the
+ * refill fast path cannot handle the miss. page_lock is dropped during
+ * swap I/O, so the handler starts over (at retry) whenever that happens
+ * before it has finished looking at the page table.
+ */
+static
+int
+vm_fault_slow(int faulttype, vaddr_t faultaddress)
 {
 	struct addrspace * as;
 	vaddr_t vbase1, vtop1, vbase2, vtop2;
@@ -208,9 +572,21 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	vbase2 = (as->as_vbase2 & PAGE_FRAME);
 	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
 	 
+	//file mappings get their pages from the vnode layer
+	struct mmregion * mr = mmap_findregion(as, faultaddress);
+	if(mr != NULL){
+		int handled;
+		int result = mmap_fault(as, mr, faulttype, faultaddress, &handled);
+		if(handled){
+			return result;
+		}
+	}
+
 	//check if valid user space address	
 	int permission;
-	if (faultaddress >= vbase1 && faultaddress < vtop1){
+	if (mr != NULL){
+		permission = mr->mr_prot;
+	}else if (faultaddress >= vbase1 && faultaddress < vtop1){
 		permission = as->permissionv1;
 	}else if (faultaddress >= vbase2 && faultaddress < vtop2){
 		permission = as->permissionv2;
@@ -231,7 +607,17 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         return EFAULT;
 	}
 	
+	struct ptentry * busyentry;
+	int spare = 0;
+
 	lock_acquire(page_lock);
+ retry:
+	//someone else is reading this page in from swap; wait for them
+	busyentry = findentry(as, faultaddress);
+	if(busyentry != NULL && busyentry->busy){
+		waitentry(busyentry);
+		goto retry;
+	}
 
 	int found = 0;
 	u_int32_t entryhi = faultaddress;
@@ -248,18 +634,24 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 			assert(tempentry->count > 0);
 			found = 1;
 			if(tempentry->ondisk == 1){
-				index = findavailablepage();
+				index = fault_getframe(&spare);
+				if(index < 0){
+					goto retry;
+				}
 				if(index == 0){
-					index = findoldestpage();
-					swapout(index);
-				}	
+					lock_release(page_lock);
+					return ENOMEM;
+				}
 				swapin(tempentry, index);
 			}
 		}else{
-			index = findavailablepage();
+			index = fault_getframe(&spare);
+			if(index < 0){
+				goto retry;
+			}
 			if(index == 0){
-				index = findoldestpage();
-				swapout(index);
+				lock_release(page_lock);
+				return ENOMEM;
 			}
 			paddress = page_alloc(as, faultaddress, index, 'v');
 			tempentry = addentry(as, faultaddress, paddress);
@@ -276,7 +668,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		if(result < 0){
 			entryhi = faultaddress;
 			int spl = splhigh();	
-			TLB_Random(entryhi, entrylo);	
+			tlb_replace(entryhi, entrylo);	
 			splx(spl);
 		}else {
 			entryhi = faultaddress;
@@ -298,10 +690,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 			
 			if(tempentry->count == 1){
 				if(tempentry->ondisk == 1){
-					index = findavailablepage();
+					index = fault_getframe(&spare);
+					if(index < 0){
+						goto retry;
+					}
 					if(index == 0){
-						index = findoldestpage();
-						swapout(index);
+						lock_release(page_lock);
+						return ENOMEM;
 					}
 					swapin(tempentry, index);
 
@@ -315,10 +710,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 				}
 			}else{
 				if(tempentry->ondisk == 1){
-					index = findavailablepage();
+					index = fault_getframe(&spare);
+					if(index < 0){
+						goto retry;
+					}
 					if(index == 0){
-						index = findoldestpage();
-						swapout(index);
+						lock_release(page_lock);
+						return ENOMEM;
 					}
 					paddress = page_alloc(as, faultaddress, index, 'v');				
 					tempentry = swapentry(as, tempentry, paddress);	
@@ -328,10 +726,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 					entrylo |= (TLBLO_VALID);
 					entrylo &= (~TLBLO_DIRTY);
 				}else {
-					index = findavailablepage();
+					index = fault_getframe(&spare);
+					if(index < 0){
+						goto retry;
+					}
 					if(index == 0){
-						index = findoldestpage();
-						swapout(index);
+						lock_release(page_lock);
+						return ENOMEM;
 					}
 					paddress = page_alloc(as, faultaddress, index, 'v');				
 					tempentry = copyentry(as, tempentry, paddress);	
@@ -342,10 +743,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 				}			
 			}
 		}else if (found == 0){
-			index = findavailablepage();
+			index = fault_getframe(&spare);
+			if(index < 0){
+				goto retry;
+			}
 			if(index == 0){
-				index = findoldestpage();
-				swapout(index);
+				lock_release(page_lock);
+				return ENOMEM;
 			}
 			paddress = page_alloc(as, faultaddress, index, 'v');
 			tempentry = addentry(as, faultaddress, paddress);
@@ -361,7 +765,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		int result = TLB_Probe(faultaddress, 0);
 		if(result < 0){
 			entryhi = faultaddress;	
-			TLB_Random(entryhi, entrylo);	
+			tlb_replace(entryhi, entrylo);	
 		}else {
 			entryhi = faultaddress;	
 			TLB_Write(entryhi, entrylo, result);	
@@ -378,26 +782,36 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 			assert(tempentry->count > 0);
 			found = 1;
 
-			if(((permission & 2) >> 1) == 1){			
-				int spl = splhigh();				
+			if(((permission & 2) >> 1) == 1){
+				int index = 0, spl;
+
+				//a shared page needs its own frame: get it
+				//before splhigh, evicting for it writes to swap
+				if(tempentry->count > 1){
+					index = fault_getframe(&spare);
+					if(index < 0){
+						goto retry;
+					}
+					if(index == 0){
+						lock_release(page_lock);
+						return ENOMEM;
+					}
+				}
+
+				spl = splhigh();
 				if(tempentry->count == 1){
 					result = TLB_Probe(faultaddress, 0);
 					if(result < 0){
 						entrylo = tempentry->paddress;						
 						entrylo |= (TLBLO_VALID);
 						entrylo |= (TLBLO_DIRTY);
-						TLB_Random(faultaddress, entrylo);
+						tlb_replace(faultaddress, entrylo);
 					}else{
 						TLB_Read(&vaddress, &paddress, result);				
 						paddress |= (TLBLO_DIRTY);		
 						TLB_Write(vaddress, paddress, result);
 					}	
 				}else{
-					int index = findavailablepage();
-					if(index == 0){
-						index = findoldestpage();
-						swapout(index);
-					}
 					paddress = page_alloc(as, faultaddress, index, 'v');				
 					tempentry = copyentry(as, tempentry, paddress);						
 
@@ -406,7 +820,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 						entrylo = paddress;						
 						entrylo |= (TLBLO_VALID);
 						entrylo |= (TLBLO_DIRTY);						
-						TLB_Random(vaddress, entrylo);
+						tlb_replace(faultaddress, entrylo);
 					}else{
 						TLB_Read(&vaddress, &paddress, result);				
 						entrylo = paddress;						
@@ -423,6 +837,10 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		}
 
 	}
+	//let any paging hint on this address drive readahead/drop-behind
+	vm_advice_fault(as, faultaddress);
+	fault_putframe(&spare);
+
 	int spl = splhigh();
 	lock_release(page_lock);
 
@@ -471,6 +889,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
                 splx(spl);
                 return result;
             }
+            exectrace_fault(as, faultaddress);
             
             vfs_close(v);            
 
@@ -506,6 +925,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
                 splx(spl);
                 return result;
             }
+            exectrace_fault(as, faultaddress);
             vfs_close(v);
         }
         result = as_complete_load(curthread->t_vmspace);
@@ -519,6 +939,113 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	return 0;
 }
 
+/*
+ * TLB refill fast path. Handles a miss on a page that is already in the
+ * page table and resident: one page table walk and one TLB write at
+ * splhigh, with no lock and no sleeping. Returns -1 if this is a real
+ * fault (not mapped, on disk, copy-on-write, not writable) or if
+ * someone holds page_lock and might be halfway through changing the
+ * page tables; vm_fault_slow deals with those.
+ */
+static
+int
+vm_tlbrefill(int faulttype, vaddr_t faultaddress){
+	struct addrspace * as = curthread->t_vmspace;
+	struct ptlist * templist;
+	struct ptentry * tempentry = NULL;
+	u_int32_t entrylo;
+	int spl;
+
+	if(as == NULL || faulttype == VM_FAULT_READONLY){
+		return -1;
+	}
+
+	spl = splhigh();
+	if(page_lock->isHeld){
+		refill_busy++;
+		splx(spl);
+		return -1;
+	}
+
+	for(templist = as->head; templist != NULL; templist = templist->next){
+		if(templist->entry->vaddress == faultaddress){
+			tempentry = templist->entry;
+			break;
+		}
+	}
+
+	//TRASH means pinned or being written out; let the slow path decide
+	if(tempentry == NULL || tempentry->ondisk != 0 || tempentry->paddress == 0 ||
+	   coremap[tempentry->paddress/PAGE_SIZE]->status != DIRTY){
+		splx(spl);
+		return -1;
+	}
+
+	entrylo = tempentry->paddress | TLBLO_VALID;
+	if(faulttype == VM_FAULT_WRITE){
+		if(tempentry->count != 1 || (tempentry->permission & 2) == 0){
+			splx(spl);
+			return -1;
+		}
+		entrylo |= TLBLO_DIRTY;
+	}
+
+	//this is a miss, so the address cannot already be in the TLB
+	tlb_replace(faultaddress, entrylo);
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Add the time since S1/NS1 to a latency total.
+ */
+static
+void
+fault_addtime(time_t s1, u_int32_t ns1, time_t * secs, u_int32_t * nsecs){
+	time_t s2, rs;
+	u_int32_t ns2, rns;
+
+	gettime(&s2, &ns2);
+	getinterval(s1, ns1, s2, ns2, &rs, &rns);
+	*secs += rs;
+	*nsecs += rns;
+	if(*nsecs >= 1000000000){
+		*nsecs -= 1000000000;
+		(*secs)++;
+	}
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	time_t s1 = 0;
+	u_int32_t ns1 = 0;
+	int result, sample;
+
+	//reading the clock costs about as much as a refill, so only sample
+	sample = (++fault_count % FAULT_SAMPLE) == 0;
+	if(sample){
+		gettime(&s1, &ns1);
+	}
+
+	if(vm_tlbrefill(faulttype, faultaddress & PAGE_FRAME) == 0){
+		refill_fast++;
+		if(sample){
+			fault_addtime(s1, ns1, &refill_fastsecs, &refill_fastnsecs);
+			refill_fastsamples++;
+		}
+		return 0;
+	}
+
+	result = vm_fault_slow(faulttype, faultaddress);
+	refill_slow++;
+	if(sample){
+		fault_addtime(s1, ns1, &refill_slowsecs, &refill_slownsecs);
+		refill_slowsamples++;
+	}
+	return result;
+}
+
 paddr_t 
 page_alloc(struct addrspace *addrspace, vaddr_t vaddress, int index, char from){
 
@@ -528,6 +1055,7 @@ page_alloc(struct addrspace *addrspace, vaddr_t vaddress, int index, char from){
 	coremap[index]->as = addrspace;
 	coremap[index]->vaddress = vaddress;
 	coremap[index]->status = DIRTY;
+	coremap[index]->obj = NULL;
 
 	time_t secs;
 	u_int32_t nsecs; 	
@@ -555,6 +1083,12 @@ findavailablepage(){
 	return 0;
 }
 
+/*
+ * Pick the least recently used page that swapout can evict: a resident
+ * user page (DIRTY with an owner) or a page of a vm object. Frames that
+ * are free, pinned, in transit or kernel memory are TRASH or have no
+ * owner and are skipped. Returns -1 if there is nothing to evict.
+ */
 int
 findoldestpage(){
 	time_t secs = 1599999999;
@@ -564,49 +1098,523 @@ findoldestpage(){
 	index = -1;
 	int spl = splhigh();
 	for(i = num_trash + 1; i < totalnumpages - 1; i++){
-		if(coremap[i]->status != TRASH){
-			if(coremap[i]->secs < secs){
-				secs = coremap[i]->secs;
-				nsecs = coremap[i]->nsecs;
-				index = i;
-			}else if (coremap[i]->secs == secs && coremap[i]->nsecs < nsecs){
-				nsecs = coremap[i]->nsecs;
-				index = i;
-			}		
-		}
-	}	
-
-	if(index != -1){
+		if(coremap[i]->status != DIRTY ||
+		   (coremap[i]->as == NULL && coremap[i]->obj == NULL)){
+			continue;
+		}
+		if(coremap[i]->secs < secs){
+			secs = coremap[i]->secs;
+			nsecs = coremap[i]->nsecs;
+			index = i;
+		}else if (coremap[i]->secs == secs && coremap[i]->nsecs < nsecs){
+			nsecs = coremap[i]->nsecs;
+			index = i;
+		}
+	}
+	splx(spl);
+	return index;
+}
+
+/*
+ * Queue a page of AS for prefetch from swap. Safe to call at splhigh.
+ */
+static
+void
+prefetch_enqueue(struct addrspace * as, vaddr_t vaddress){
+	int spl = splhigh();
+	int next = (prefetch_tail + 1) % PREFETCH_MAX;
+
+	if(next == prefetch_head){
 		splx(spl);
-		return index;
+		return;
 	}
 
-	secs = 1599999999;
-	nsecs = 0;
-	if(index == -1){
-		for(i = num_trash + 1; i < totalnumpages-1; i++){
-			if(coremap[i]->secs < secs){
-				secs = coremap[i]->secs;
-				nsecs = coremap[i]->nsecs;
-				index = i;
-			}else if (coremap[i]->secs == secs && coremap[i]->nsecs < nsecs){
-				nsecs = coremap[i]->nsecs;
-				index = i;
-			}	
+	prefetch_queue[prefetch_tail].as = as;
+	prefetch_queue[prefetch_tail].vaddress = vaddress;
+	prefetch_tail = next;
+	splx(spl);
+
+	V(prefetch_sem);
+}
+
+/*
+ * Drop any queued prefetches for AS. Called when the address space goes
+ * away so the prefetch thread never looks at a freed page table.
+ */
+void
+prefetch_purge(struct addrspace * as){
+	int i;
+	int spl = splhigh();
+
+	for(i = prefetch_head; i != prefetch_tail; i = (i + 1) % PREFETCH_MAX){
+		if(prefetch_queue[i].as == as){
+			prefetch_queue[i].as = NULL;
 		}
 	}
 	splx(spl);
-	return index;
 }
 
+/*
+ * Background thread that swaps in pages queued by MADV_WILLNEED and by
+ * sequential readahead. Speculative reads only ever use free frames; we
+ * never evict something to make room for a page nobody has touched yet.
+ */
+static
+void
+prefetch_thread(void * unused, unsigned long junk){
+	struct addrspace * as;
+	struct ptentry * tempentry;
+	vaddr_t vaddress;
+	int index, spl;
+
+	(void)unused;
+	(void)junk;
+
+	while(1){
+		P(prefetch_sem);
+
+		lock_acquire(page_lock);
+		spl = splhigh();
+		if(prefetch_head == prefetch_tail){
+			splx(spl);
+			lock_release(page_lock);
+			continue;
+		}
+		as = prefetch_queue[prefetch_head].as;
+		vaddress = prefetch_queue[prefetch_head].vaddress;
+		prefetch_head = (prefetch_head + 1) % PREFETCH_MAX;
+		splx(spl);
+
+		if(as != NULL){
+			tempentry = findentry(as, vaddress);
+			if(tempentry != NULL && tempentry->ondisk == 1 && !tempentry->busy){
+				index = findavailablepage();
+				if(index != 0){
+					swapin_as(as, tempentry, index);
+				}
+			}
+		}
+		lock_release(page_lock);
+	}
+}
+
+/*
+ * Return the advice recorded for VADDRESS in AS, or MADV_NORMAL.
+ */
+static
+int
+vm_advice_lookup(struct addrspace * as, vaddr_t vaddress){
+	struct advrange * range;
+
+	for(range = as->as_advice; range != NULL; range = range->next){
+		if(vaddress >= range->start && vaddress < range->end){
+			return range->advice;
+		}
+	}
+	return MADV_NORMAL;
+}
+
+/*
+ * Called from vm_fault with page_lock held once FAULTADDRESS is mapped.
+ * For sequential ranges read the next few pages ahead and push the page
+ * behind us to the front of the eviction order.
+ */
+void
+vm_advice_fault(struct addrspace * as, vaddr_t faultaddress){
+	struct ptentry * tempentry;
+	vaddr_t behind;
+	int i;
+
+	if(as->as_advice == NULL){
+		return;
+	}
+	if(vm_advice_lookup(as, faultaddress) != MADV_SEQUENTIAL){
+		return;
+	}
+
+	for(i = 1; i <= MADV_READAHEAD; i++){
+		vaddr_t ahead = faultaddress + i * PAGE_SIZE;
+		if(vm_advice_lookup(as, ahead) != MADV_SEQUENTIAL){
+			break;
+		}
+		tempentry = findentry(as, ahead);
+		if(tempentry != NULL && tempentry->ondisk == 1){
+			prefetch_enqueue(as, ahead);
+		}
+	}
+
+	behind = faultaddress - MADV_READAHEAD * PAGE_SIZE;
+	if(behind < faultaddress && vm_advice_lookup(as, behind) == MADV_SEQUENTIAL){
+		tempentry = findentry(as, behind);
+		if(tempentry != NULL && tempentry->ondisk == 0 && tempentry->count == 1){
+			int spl = splhigh();
+			int index = tempentry->paddress/PAGE_SIZE;
+			//oldest possible timestamp, so findoldestpage picks it first
+			coremap[index]->secs = 0;
+			coremap[index]->nsecs = 0;
+			splx(spl);
+		}
+	}
+}
+
+/*
+ * Record ADVICE for [START, END), replacing whatever was there before.
+ * MADV_NORMAL just clears the range.
+ */
+static
+int
+vm_advice_set(struct addrspace * as, vaddr_t start, vaddr_t end, int advice){
+	struct advrange ** prev;
+	struct advrange * range;
+	struct advrange * split;
+
+	prev = &as->as_advice;
+	while(*prev != NULL){
+		range = *prev;
+		if(range->end <= start || range->start >= end){
+			prev = &range->next;
+			continue;
+		}
+		if(range->start < start && range->end > end){
+			//new range sits in the middle of this one, split it
+			split = kmalloc(sizeof(struct advrange));
+			if(split == NULL){
+				return ENOMEM;
+			}
+			split->start = end;
+			split->end = range->end;
+			split->advice = range->advice;
+			split->next = range->next;
+			range->end = start;
+			range->next = split;
+			prev = &split->next;
+		}else if(range->start < start){
+			range->end = start;
+			prev = &range->next;
+		}else if(range->end > end){
+			range->start = end;
+			prev = &range->next;
+		}else{
+			*prev = range->next;
+			kfree(range);
+		}
+	}
+
+	if(advice == MADV_NORMAL){
+		return 0;
+	}
 
+	range = kmalloc(sizeof(struct advrange));
+	if(range == NULL){
+		return ENOMEM;
+	}
+	range->start = start;
+	range->end = end;
+	range->advice = advice;
+	range->next = as->as_advice;
+	as->as_advice = range;
+	return 0;
+}
 
+/*
+ * Copy the paging hints of OLD into NEWAS on fork.
+ */
+int
+vm_advice_copy(struct addrspace * old, struct addrspace * newas){
+	struct advrange * range;
+	struct advrange * newrange;
+
+	for(range = old->as_advice; range != NULL; range = range->next){
+		newrange = kmalloc(sizeof(struct advrange));
+		if(newrange == NULL){
+			return ENOMEM;
+		}
+		newrange->start = range->start;
+		newrange->end = range->end;
+		newrange->advice = range->advice;
+		newrange->next = newas->as_advice;
+		newas->as_advice = newrange;
+	}
+	return 0;
+}
 
+void
+vm_advice_destroy(struct addrspace * as){
+	struct advrange * range;
 
+	while(as->as_advice != NULL){
+		range = as->as_advice;
+		as->as_advice = range->next;
+		kfree(range);
+	}
+}
 
+/*
+ * Throw away the pages of AS in [START, END): frames go back on the free
+ * list and swap slots are released. The next touch gets a fresh zeroed
+ * page. Pages still shared copy-on-write with another address space only
+ * lose our reference; the other sharers keep theirs.
+ */
+void
+vm_dropentries(struct addrspace * as, vaddr_t start, vaddr_t end){
+	struct ptlist ** prev;
+	struct ptlist * templist;
+	struct ptentry * tempentry;
 
+	lock_acquire(page_lock);
+	int spl = splhigh();
 
+	prev = &as->head;
+	while(*prev != NULL){
+		templist = *prev;
+		tempentry = templist->entry;
 
+		if(tempentry->vaddress < start || tempentry->vaddress >= end){
+			prev = &templist->next;
+			continue;
+		}
+		if(tempentry->busy){
+			//being swapped in; the list may change while we wait
+			waitentry(tempentry);
+			prev = &as->head;
+			continue;
+		}
 
+		*prev = templist->next;
+		disownframe(as, tempentry);
+		freeentry(tempentry);
+		kfree(templist);
+	}
 
+	as_activate(NULL);
+	splx(spl);
+	lock_release(page_lock);
+}
 
+/*
+ * madvise() system call. ADDR must be page aligned and the whole range
+ * must lie in the heap or the stack of the calling process.
+ */
+int
+sys_madvise(userptr_t addr, size_t len, int advice){
+	struct addrspace * as = curthread->t_vmspace;
+	vaddr_t start = (vaddr_t)addr;
+	vaddr_t end;
+	vaddr_t vaddress;
+	struct ptentry * tempentry;
+	int result = 0;
+
+	if(as == NULL){
+		return EFAULT;
+	}
+	if((start & ~(vaddr_t)PAGE_FRAME) != 0){
+		return EINVAL;
+	}
+
+	end = (start + len + PAGE_SIZE - 1) & PAGE_FRAME;
+	if(end < start){
+		return EINVAL;
+	}
+	if(end == start){
+		return 0;
+	}
+
+	if(!(start >= as->as_heapStart && end <= as->as_heapEnd) &&
+	   !(start >= as->as_stackvbase && end <= USERSTACK)){
+		return EINVAL;
+	}
+
+	switch(advice){
+	    case MADV_NORMAL:
+	    case MADV_RANDOM:
+	    case MADV_SEQUENTIAL:
+		result = vm_advice_set(as, start, end, advice);
+		break;
+	    case MADV_WILLNEED:
+		lock_acquire(page_lock);
+		for(vaddress = start; vaddress < end; vaddress += PAGE_SIZE){
+			tempentry = findentry(as, vaddress);
+			if(tempentry != NULL && tempentry->ondisk == 1){
+				prefetch_enqueue(as, vaddress);
+			}
+		}
+		lock_release(page_lock);
+		break;
+	    case MADV_DONTNEED:
+		vm_dropentries(as, start, end);
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	return result;
+}
+
+/*
+ * Find NUMPAGES free frames in a row. Returns the first index, or 0.
+ */
+int
+findavailablerun(int numpages){
+	int i, run = 0;
+	int spl = splhigh();
+
+	for(i = num_trash + 1; i < totalnumpages - 1; i++){
+		if(coremap[i]->status == FREE){
+			run++;
+			if(run == numpages){
+				splx(spl);
+				return i - numpages + 1;
+			}
+		}else{
+			run = 0;
+		}
+	}
+
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Move the user page in frame FROM to the free frame TO, fixing up its
+ * page table entry. Entries shared copy-on-write are a single ptentry,
+ * so every sharer follows the move. Returns EINVAL if FROM does not hold
+ * a movable user page and EBUSY if TO is not free. Called with page_lock
+ * held, since whoever holds it may be about to use the old paddress.
+ */
+int
+migratepage(int from, int to){
+	struct ptentry * tempentry;
+
+	assert(lock_do_i_hold(page_lock));
+	int spl = splhigh();
+
+	if(coremap[to]->status != FREE){
+		splx(spl);
+		return EBUSY;
+	}
+	if(coremap[from]->status != DIRTY || coremap[from]->as == NULL){
+		splx(spl);
+		return EINVAL;
+	}
+
+	tempentry = findentry(coremap[from]->as, coremap[from]->vaddress);
+	if(tempentry == NULL || tempentry->ondisk == 1 ||
+	   tempentry->paddress != (paddr_t)from*PAGE_SIZE){
+		splx(spl);
+		return EINVAL;
+	}
+
+	memcpy((void *)PADDR_TO_KVADDR(to*PAGE_SIZE), (const void *)PADDR_TO_KVADDR(from*PAGE_SIZE), PAGE_SIZE);
+	tempentry->paddress = to*PAGE_SIZE;
+
+	coremap[to]->as = coremap[from]->as;
+	coremap[to]->vaddress = coremap[from]->vaddress;
+	coremap[to]->status = DIRTY;
+	coremap[to]->obj = NULL;
+	coremap[to]->secs = coremap[from]->secs;
+	coremap[to]->nsecs = coremap[from]->nsecs;
+
+	coremap[from]->as = NULL;
+	coremap[from]->vaddress = 0;
+	coremap[from]->status = FREE;
+
+	//the old translation may still be in the TLB
+	as_activate(NULL);
+
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Gather NUMPAGES free frames into one contiguous run by migrating user
+ * pages out of the way. Picks the window with no kernel frames that needs
+ * the fewest moves, and moves its user pages to free frames outside it.
+ * Returns the first index of the run, or 0 if it could not be done.
+ * Called with page_lock held, by a caller that is not in the middle of
+ * using any user page's physical address.
+ */
+int
+compact_window(int numpages){
+	int i, j, best, bestcost, cost, pinned;
+	int spl = splhigh();
+
+	compact_runs++;
+
+	best = 0;
+	bestcost = numpages + 1;
+	for(i = num_trash + 1; i + numpages <= totalnumpages - 1; i++){
+		cost = 0;
+		pinned = 0;
+		for(j = i; j < i + numpages; j++){
+			compact_scanned++;
+			if(coremap[j]->status == FREE){
+				continue;
+			}
+			if(coremap[j]->status != DIRTY || coremap[j]->as == NULL){
+				pinned = 1;
+				break;
+			}
+			cost++;
+		}
+		if(!pinned && cost < bestcost){
+			best = i;
+			bestcost = cost;
+			if(cost == 0){
+				break;
+			}
+		}
+	}
+
+	if(best == 0){
+		compact_fail++;
+		splx(spl);
+		return 0;
+	}
+
+	j = num_trash + 1;
+	for(i = best; i < best + numpages; i++){
+		if(coremap[i]->status == FREE){
+			continue;
+		}
+		//next free frame outside the window
+		while(j < totalnumpages - 1 &&
+		      (coremap[j]->status != FREE || (j >= best && j < best + numpages))){
+			j++;
+		}
+		if(j >= totalnumpages - 1 || migratepage(i, j) != 0){
+			compact_fail++;
+			splx(spl);
+			return 0;
+		}
+		compact_migrated++;
+	}
+
+	compact_success++;
+	splx(spl);
+	return best;
+}
+
+/*
+ * Compact for a run of NUMPAGES frames; see compact_window. Called from
+ * alloc_kpages. If page_lock is free we take it, which cannot block.
+ * If anyone holds it, our own caller included (tmpfs_setsize kmallocs
+ * under it), they may be halfway through using a page we would move, so
+ * we give up and return 0.
+ */
+int
+vm_compact(int numpages){
+	int index;
+	int spl = splhigh();
+
+	if(page_lock->isHeld){
+		compact_busy++;
+		splx(spl);
+		return 0;
+	}
+	lock_acquire(page_lock);
+	index = compact_window(numpages);
+	lock_release(page_lock);
+
+	splx(spl);
+	return index;
+}
@@ -0,0 +1,428 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <thread.h>
+#include <curthread.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/spl.h>
+#include <machine/vm.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+
+/*
+ * VM objects.
+ *
+ * A vmobject is a run of pages that do not belong to any one page table:
+ * the pages of a mapped file, or of anything else several address spaces
+ * need to see through the same frames. Each page is either resident in a
+ * coremap frame, parked in a swap slot, or not there yet.
+ *
+ * Resident object pages have coremap status DIRTY with as == NULL and
+ * obj/objpage naming the owner, so findoldestpage considers them like
+ * any other user page and swapout hands them to vmobject_evict. Pages of
+ * a file object go back to the file; pages of an anonymous object go to
+ * the swap device, the same as ordinary anonymous memory.
+ *
+ * All of this runs under page_lock, including the VOP_READ and VOP_WRITE
+ * on a file object's vnode, so a filesystem whose I/O takes page_lock
+ * (tmpfs) cannot back one; sys_mmap refuses its files. The exception is
+ * evicting a user page to make room in vmobject_getpage, which lets go
+ * of the lock while the page is written to swap.
+ */
+
+/* file objects, so every mapping of a vnode shares one set of frames */
+static struct vmobject * fileobjects;
+
+/*
+ * Create an object of NPAGES pages. V is the (already opened) backing
+ * file or NULL for an anonymous object; the object takes over the open
+ * reference and vfs_closes it when the last user goes away.
+ */
+struct vmobject *
+vmobject_create(struct vnode * v, int npages){
+	struct vmobject * obj;
+	int i;
+
+	obj = kmalloc(sizeof(struct vmobject));
+	if(obj == NULL){
+		return NULL;
+	}
+	obj->vo_frames = kmalloc(npages * sizeof(int));
+	obj->vo_slots = kmalloc(npages * sizeof(int));
+	obj->vo_dirty = kmalloc(npages);
+	if(obj->vo_frames == NULL || obj->vo_slots == NULL || obj->vo_dirty == NULL){
+		kfree(obj->vo_frames);
+		kfree(obj->vo_slots);
+		kfree(obj->vo_dirty);
+		kfree(obj);
+		return NULL;
+	}
+
+	for(i = 0; i < npages; i++){
+		obj->vo_frames[i] = 0;
+		obj->vo_slots[i] = 0;
+		obj->vo_dirty[i] = 0;
+	}
+	obj->vo_vnode = v;
+	obj->vo_npages = npages;
+	obj->vo_refcount = 1;
+	obj->vo_flags = 0;
+	obj->vo_next = NULL;
+
+	if(v != NULL){
+		obj->vo_next = fileobjects;
+		fileobjects = obj;
+	}
+	return obj;
+}
+
+/*
+ * Get the object for the opened vnode V, creating it if nobody has the
+ * file mapped yet. If an object already exists we take a reference on it
+ * and close V, since the object has its own open.
+ */
+struct vmobject *
+vmobject_lookup(struct vnode * v, int npages){
+	struct vmobject * obj;
+
+	for(obj = fileobjects; obj != NULL; obj = obj->vo_next){
+		if(obj->vo_vnode == v){
+			obj->vo_refcount++;
+			vfs_close(v);
+			return obj;
+		}
+	}
+	return vmobject_create(v, npages);
+}
+
+/*
+ * Write page PGNO of a file object back to its vnode, stopping at the
+ * end of the file so a mapping never extends it.
+ */
+static
+int
+vmobject_writeback(struct vmobject * obj, int pgno){
+	struct stat st;
+	struct uio tempuio;
+	off_t offset = (off_t)pgno * PAGE_SIZE;
+	size_t len = PAGE_SIZE;
+	int index = obj->vo_frames[pgno];
+	int result;
+
+	assert(obj->vo_vnode != NULL && index != 0);
+
+	result = VOP_STAT(obj->vo_vnode, &st);
+	if(result){
+		return result;
+	}
+	if(offset >= st.st_size){
+		obj->vo_dirty[pgno] = 0;
+		return 0;
+	}
+	if(st.st_size - offset < (off_t)len){
+		len = st.st_size - offset;
+	}
+
+	mk_kuio(&tempuio, (void *)PADDR_TO_KVADDR(index*PAGE_SIZE), len, offset, UIO_WRITE);
+	result = VOP_WRITE(obj->vo_vnode, &tempuio);
+	if(result){
+		return result;
+	}
+	obj->vo_dirty[pgno] = 0;
+	return 0;
+}
+
+/*
+ * Grow or shrink OBJ to NPAGES pages. Pages cut off the end lose their
+ * frames and swap slots; new pages start out as zeros.
+ */
+int
+vmobject_resize(struct vmobject * obj, int npages){
+	int * frames;
+	int * slots;
+	char * dirty;
+	int i, keep;
+
+	if(npages == obj->vo_npages){
+		return 0;
+	}
+
+	frames = kmalloc((npages > 0 ? npages : 1) * sizeof(int));
+	slots = kmalloc((npages > 0 ? npages : 1) * sizeof(int));
+	dirty = kmalloc(npages > 0 ? npages : 1);
+	if(frames == NULL || slots == NULL || dirty == NULL){
+		kfree(frames);
+		kfree(slots);
+		kfree(dirty);
+		return ENOMEM;
+	}
+
+	keep = npages < obj->vo_npages ? npages : obj->vo_npages;
+	for(i = 0; i < keep; i++){
+		frames[i] = obj->vo_frames[i];
+		slots[i] = obj->vo_slots[i];
+		dirty[i] = obj->vo_dirty[i];
+	}
+	for(i = keep; i < npages; i++){
+		frames[i] = 0;
+		slots[i] = 0;
+		dirty[i] = 0;
+	}
+
+	int spl = splhigh();
+	for(i = keep; i < obj->vo_npages; i++){
+		if(obj->vo_frames[i] != 0){
+			coremap[obj->vo_frames[i]]->obj = NULL;
+			coremap[obj->vo_frames[i]]->objpage = 0;
+			coremap[obj->vo_frames[i]]->status = FREE;
+		}
+		if(obj->vo_slots[i] != 0){
+			swap_free(obj->vo_slots[i]);
+		}
+	}
+	kfree(obj->vo_frames);
+	kfree(obj->vo_slots);
+	kfree(obj->vo_dirty);
+	obj->vo_frames = frames;
+	obj->vo_slots = slots;
+	obj->vo_dirty = dirty;
+	obj->vo_npages = npages;
+	as_activate(NULL);
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Make page PGNO of OBJ resident and return its coremap index, or 0 if
+ * the page could not be read. Called with page_lock held. If a page has
+ * to be evicted first, page_lock is released while it is written, so
+ * anything else the caller looked up under the lock may have changed.
+ */
+int
+vmobject_getpage(struct vmobject * obj, int pgno){
+	struct uio tempuio;
+	int index, result, spl;
+	time_t secs;
+	u_int32_t nsecs;
+
+	assert(lock_do_i_hold(page_lock));
+	assert(pgno >= 0 && pgno < obj->vo_npages);
+
+	if(obj->vo_frames[pgno] != 0){
+		return obj->vo_frames[pgno];
+	}
+
+	index = findavailablepage();
+	if(index == 0){
+		index = findoldestpage();
+		if(index < 0){
+			return 0;
+		}
+		swapout_droplock(index);
+
+		//keep the frame while we look again: the object may have been
+		//shrunk, or the page brought in, while the lock was free
+		spl = splhigh();
+		coremap[index]->status = TRASH;
+		splx(spl);
+		if(pgno >= obj->vo_npages || obj->vo_frames[pgno] != 0){
+			spl = splhigh();
+			coremap[index]->status = FREE;
+			splx(spl);
+			return pgno < obj->vo_npages ? obj->vo_frames[pgno] : 0;
+		}
+	}
+
+	//TRASH while we fill it, so nobody picks it for eviction mid-read
+	spl = splhigh();
+	coremap[index]->status = TRASH;
+	coremap[index]->as = NULL;
+	coremap[index]->vaddress = 0;
+	coremap[index]->obj = obj;
+	coremap[index]->objpage = pgno;
+	gettime(&secs, &nsecs);
+	coremap[index]->secs = secs;
+	coremap[index]->nsecs = nsecs;
+	splx(spl);
+
+	bzero((void *)PADDR_TO_KVADDR(index*PAGE_SIZE), PAGE_SIZE);
+
+	if(obj->vo_slots[pgno] != 0){
+		result = swap_read(obj->vo_slots[pgno], index);
+	}else if(obj->vo_vnode != NULL){
+		//a short read past end of file just leaves the rest zeroed
+		mk_kuio(&tempuio, (void *)PADDR_TO_KVADDR(index*PAGE_SIZE), PAGE_SIZE,
+			(off_t)pgno*PAGE_SIZE, UIO_READ);
+		result = VOP_READ(obj->vo_vnode, &tempuio);
+	}else{
+		result = 0;
+	}
+
+	if(result){
+		spl = splhigh();
+		coremap[index]->status = FREE;
+		coremap[index]->obj = NULL;
+		splx(spl);
+		return 0;
+	}
+
+	spl = splhigh();
+	coremap[index]->status = DIRTY;
+	obj->vo_frames[pgno] = index;
+	splx(spl);
+	return index;
+}
+
+void
+vmobject_setdirty(struct vmobject * obj, int pgno){
+	assert(pgno >= 0 && pgno < obj->vo_npages);
+	obj->vo_dirty[pgno] = 1;
+}
+
+/*
+ * Push page PGNO of OBJ out of memory. File pages are written back if
+ * dirty; anonymous pages go to a swap slot, which they keep until the
+ * object is destroyed.
+ */
+static
+void
+vmobject_evictpage(struct vmobject * obj, int pgno){
+	int index = obj->vo_frames[pgno];
+	int result;
+
+	assert(index != 0 && coremap[index]->obj == obj);
+
+	if(obj->vo_vnode != NULL){
+		if(obj->vo_dirty[pgno]){
+			result = vmobject_writeback(obj, pgno);
+			if(result){
+				kprintf("vmobject: writeback failed Error: %d\n", result);
+			}
+		}
+	}else{
+		if(obj->vo_slots[pgno] == 0){
+			obj->vo_slots[pgno] = swap_alloc();
+		}
+		if(obj->vo_slots[pgno] == 0){
+			panic("vmobject: out of swap\n");
+		}
+		result = swap_write(obj->vo_slots[pgno], index);
+		if(result){
+			kprintf("VOP WRITE FAILED Error: %d\n", result);
+		}
+	}
+
+	int spl = splhigh();
+	obj->vo_frames[pgno] = 0;
+	coremap[index]->obj = NULL;
+	coremap[index]->objpage = 0;
+	coremap[index]->status = FREE;
+	splx(spl);
+}
+
+/*
+ * Evict the object page in coremap frame INDEX. Called from swapout.
+ * Objects marked VO_EVICTUNIT go out all at once, so a segment is either
+ * in memory or not rather than trickling out a page at a time.
+ */
+void
+vmobject_evict(int index){
+	struct vmobject * obj = coremap[index]->obj;
+	int pgno;
+
+	assert(obj != NULL && obj->vo_frames[coremap[index]->objpage] == index);
+
+	if(obj->vo_flags & VO_EVICTUNIT){
+		for(pgno = 0; pgno < obj->vo_npages; pgno++){
+			if(obj->vo_frames[pgno] != 0){
+				vmobject_evictpage(obj, pgno);
+			}
+		}
+	}else{
+		vmobject_evictpage(obj, coremap[index]->objpage);
+	}
+
+	//mappings of object pages are only ever in the TLB
+	as_activate(NULL);
+}
+
+/*
+ * Write back the dirty resident pages of a file object in [FIRST, LAST).
+ */
+int
+vmobject_sync(struct vmobject * obj, int first, int last){
+	int pgno, result;
+
+	if(obj->vo_vnode == NULL){
+		return 0;
+	}
+	if(last > obj->vo_npages){
+		last = obj->vo_npages;
+	}
+
+	for(pgno = first; pgno < last; pgno++){
+		if(obj->vo_frames[pgno] != 0 && obj->vo_dirty[pgno]){
+			result = vmobject_writeback(obj, pgno);
+			if(result){
+				return result;
+			}
+		}
+	}
+
+	//the pages are clean again, so the next write has to fault
+	as_activate(NULL);
+	return 0;
+}
+
+/*
+ * Drop a reference. The last one writes back dirty file pages, frees the
+ * frames and swap slots and closes the file.
+ */
+void
+vmobject_release(struct vmobject * obj){
+	struct vmobject ** prev;
+	int pgno, index;
+
+	assert(obj->vo_refcount > 0);
+	obj->vo_refcount--;
+	if(obj->vo_refcount > 0){
+		return;
+	}
+
+	vmobject_sync(obj, 0, obj->vo_npages);
+
+	int spl = splhigh();
+	for(pgno = 0; pgno < obj->vo_npages; pgno++){
+		index = obj->vo_frames[pgno];
+		if(index != 0){
+			coremap[index]->obj = NULL;
+			coremap[index]->objpage = 0;
+			coremap[index]->status = FREE;
+		}
+		if(obj->vo_slots[pgno] != 0){
+			swap_free(obj->vo_slots[pgno]);
+		}
+	}
+	as_activate(NULL);
+	splx(spl);
+
+	if(obj->vo_vnode != NULL){
+		for(prev = &fileobjects; *prev != NULL; prev = &(*prev)->vo_next){
+			if(*prev == obj){
+				*prev = obj->vo_next;
+				break;
+			}
+		}
+		vfs_close(obj->vo_vnode);
+	}
+
+	kfree(obj->vo_frames);
+	kfree(obj->vo_slots);
+	kfree(obj->vo_dirty);
+	kfree(obj);
+}